@@ -0,0 +1,92 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/* BC1 / BC3 / BC5 块压缩：每 4x4 个 texel 一块，texel 为 RGBA8 (R | G << 8 | B << 16 | A << 24)
+ * BC1: 8 字节，两个 RGB565 端点 + 每 texel 2 位索引，只使用不透明的 4 色模式
+ * BC3: 16 字节，BC4 编码的 Alpha + BC1 编码的颜色 (颜色块总是 4 色模式)
+ * BC5: 16 字节，两个 BC4 块分别编码 R/G，用于切线空间法线贴图，B 在解码时由单位长度重建
+ * 解码在采样时逐 texel 进行，放在头文件中以便内联 */
+namespace BC {
+    constexpr int BC1_BLOCK_BYTES = 8;
+    constexpr int BC3_BLOCK_BYTES = 16;
+    constexpr int BC5_BLOCK_BYTES = 16;
+
+    inline uint64_t load64(const uint8_t* p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // RGB565 扩展为 8 位分量 (高位复制到低位)
+    inline void expand565(uint32_t c, uint32_t& r, uint32_t& g, uint32_t& b) {
+        r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+        r = r << 3 | r >> 2;
+        g = g << 2 | g >> 4;
+        b = b << 3 | b >> 2;
+    }
+
+    // 颜色块中第 i 个 texel 的 RGB，FourColor 为 false 时按 BC1 的规则在 c0 <= c1 时切换到 3 色 + 透明模式
+    template<bool FourColor>
+    inline uint32_t decode_color(const uint8_t* block, int i) {
+        uint64_t bits = load64(block);
+        uint32_t c0 = bits & 0xFFFF, c1 = bits >> 16 & 0xFFFF;
+        uint32_t index = bits >> (32 + 2 * i) & 3;
+        uint32_t r0, g0, b0, r1, g1, b1;
+        expand565(c0, r0, g0, b0);
+        expand565(c1, r1, g1, b1);
+
+        uint32_t r, g, b, a = 255;
+        switch(index) {
+            case 0: r = r0, g = g0, b = b0; break;
+            case 1: r = r1, g = g1, b = b1; break;
+            case 2:
+                if(FourColor || c0 > c1) r = (2 * r0 + r1) / 3, g = (2 * g0 + g1) / 3, b = (2 * b0 + b1) / 3;
+                else r = (r0 + r1) / 2, g = (g0 + g1) / 2, b = (b0 + b1) / 2;
+                break;
+            default:
+                if(FourColor || c0 > c1) r = (r0 + 2 * r1) / 3, g = (g0 + 2 * g1) / 3, b = (b0 + 2 * b1) / 3;
+                else r = g = b = a = 0;
+                break;
+        }
+        return r | g << 8 | b << 16 | a << 24;
+    }
+
+    // BC4 单通道块中第 i 个 texel 的值
+    inline uint32_t decode_channel(const uint8_t* block, int i) {
+        uint64_t bits = load64(block);
+        uint32_t a0 = bits & 0xFF, a1 = bits >> 8 & 0xFF;
+        uint32_t index = bits >> (16 + 3 * i) & 7;
+        if(index == 0) return a0;
+        if(index == 1) return a1;
+        if(a0 > a1) return ((8 - index) * a0 + (index - 1) * a1) / 7;
+        if(index == 6) return 0;
+        if(index == 7) return 255;
+        return ((6 - index) * a0 + (index - 1) * a1) / 5;
+    }
+
+    inline uint32_t decode_bc1(const uint8_t* block, int i) { return decode_color<false>(block, i); }
+
+    inline uint32_t decode_bc3(const uint8_t* block, int i) {
+        return (decode_color<true>(block + 8, i) & 0x00FFFFFFu) | decode_channel(block, i) << 24;
+    }
+
+    // 由 x/y 分量重建单位法线的 z 分量 (切线空间中 z >= 0)，编码为 [0, 255]
+    inline uint32_t reconstruct_normal_z(uint32_t r, uint32_t g) {
+        float x = r * (2.f / 255.f) - 1.f, y = g * (2.f / 255.f) - 1.f;
+        float z = std::sqrt(std::max(0.f, 1.f - x * x - y * y));
+        return (uint32_t)((z * 0.5f + 0.5f) * 255.f + 0.5f);
+    }
+
+    inline uint32_t decode_bc5(const uint8_t* block, int i) {
+        uint32_t r = decode_channel(block, i), g = decode_channel(block + 8, i);
+        return r | g << 8 | reconstruct_normal_z(r, g) << 16 | 0xFFu << 24;
+    }
+
+    /* 编码一个块，texels 为按行排列的 4x4 个 texel */
+    void encode_bc1(const uint32_t texels[16], uint8_t* block);
+    void encode_bc3(const uint32_t texels[16], uint8_t* block);
+    void encode_bc5(const uint32_t texels[16], uint8_t* block);
+}
@@ -17,6 +17,8 @@ public:
     vec3 get_eye() const { return eye; }
     vec3 get_target() const { return target; }
     vec3 get_up() const { return up; }
+    float get_near() const { return zNear; }
+    float get_far() const { return zFar; }
     
     mat4 get_view_matrix() const;
     mat4 get_projection_matrix() const;
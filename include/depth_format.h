@@ -0,0 +1,62 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+/* 阴影贴图的深度存储格式
+ * 深度是 Reverse-Z 的屏幕深度，范围 [0, 1]，定点格式在编码时截断到这一范围 */
+enum class DepthFormat {
+    Float32, // 32 位浮点
+    Unorm16, // 16 位定点
+    Unorm24  // 24 位定点，3 字节紧密排列
+};
+
+/* 24 位定点深度，按小端字节序存放 */
+struct Depth24 {
+    uint8_t b[3];
+};
+
+/* 各格式的 texel 类型与编解码，深度测试与采样按格式在编译期特化 */
+template<DepthFormat F> struct DepthTraits;
+
+template<> struct DepthTraits<DepthFormat::Float32> {
+    using Texel = float;
+    static Texel encode(float z) { return z; }
+    static float decode(Texel t) { return t; }
+};
+
+template<> struct DepthTraits<DepthFormat::Unorm16> {
+    using Texel = uint16_t;
+    static constexpr float SCALE = 65535.f;
+    static Texel encode(float z) { return (Texel)(std::clamp(z, 0.f, 1.f) * SCALE + 0.5f); }
+    static float decode(Texel t) { return t * (1.f / SCALE); }
+};
+
+template<> struct DepthTraits<DepthFormat::Unorm24> {
+    using Texel = Depth24;
+    static constexpr float SCALE = 16777215.f;
+    static Texel encode(float z) {
+        uint32_t v = (uint32_t)(std::clamp(z, 0.f, 1.f) * SCALE + 0.5f);
+        return {{(uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16)}};
+    }
+    static float decode(Texel t) { return (t.b[0] | t.b[1] << 8 | t.b[2] << 16) * (1.f / SCALE); }
+};
+
+// 每个 texel 占用的字节数
+inline int depth_format_size(DepthFormat f) {
+    switch(f) {
+        case DepthFormat::Unorm16: return sizeof(DepthTraits<DepthFormat::Unorm16>::Texel);
+        case DepthFormat::Unorm24: return sizeof(DepthTraits<DepthFormat::Unorm24>::Texel);
+        default: return sizeof(DepthTraits<DepthFormat::Float32>::Texel);
+    }
+}
+
+// 把运行时的格式分派到编译期：fn 以 std::integral_constant<DepthFormat, F> 调用
+template<class Fn>
+decltype(auto) visit_depth_format(DepthFormat f, Fn&& fn) {
+    switch(f) {
+        case DepthFormat::Unorm16: return fn(std::integral_constant<DepthFormat, DepthFormat::Unorm16>{});
+        case DepthFormat::Unorm24: return fn(std::integral_constant<DepthFormat, DepthFormat::Unorm24>{});
+        default: return fn(std::integral_constant<DepthFormat, DepthFormat::Float32>{});
+    }
+}
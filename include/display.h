@@ -44,7 +44,7 @@ public:
 };
 
 void NormalMode::run(Rasterizer& r, Scene& scene) {
-    r.enable_ssaa(3); 
+    r.enable_msaa(3); 
 
     std::cout << std::endl << "--- Rendering Start :) ---" << std::endl;
     std::string timestamp = get_current_timestamp() + ".tga";
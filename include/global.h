@@ -11,8 +11,9 @@ constexpr float zFar = 100.f;
 constexpr float FLOAT_MAX = std::numeric_limits<float>::max();
 constexpr float FLOAT_MIN = std::numeric_limits<float>::min();
 
-constexpr int sm_width  = 3200;
-constexpr int sm_height = 3200;
+/* 阴影贴图：默认边长 (可在场景配置中按光源指定) 与级联数上限 */
+constexpr int sm_default_size = 2048;
+constexpr int sm_max_cascades = 4;
 
 const vec2 poisson_disk[16] = {
     {-0.94201624, -0.39906216}, {0.94558609, -0.76890725}, {-0.094184101, -0.92938870}, {0.34495938, 0.29387760},
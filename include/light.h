@@ -1,7 +1,14 @@
 #pragma once
 #include "geometry.h"
+#include "global.h"
+#include "depth_format.h"
 
 struct Light {
     vec3 position;
     vec3 intensity;
+
+    /* 阴影贴图设置 */
+    int shadow_size = sm_default_size; // 每张阴影贴图的边长
+    int cascades = 1;                  // 按视空间深度划分的级联数，1 表示不分级联
+    DepthFormat shadow_format = DepthFormat::Float32; // 深度的存储格式
 };
\ No newline at end of file
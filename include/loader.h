@@ -59,6 +59,10 @@ public:
 
         auto& cfg = data[scene_name];
 
+        // --- 解析渲染选项 ---
+        parse_render_options(cfg, scene);
+        parse_texture_options(cfg, texMgr);
+
         // --- 解析 Camera ---
         std::cout << std::endl << "=== Parsing Camera ===" << std::endl;
         parse_camera(cfg, scene);
@@ -97,12 +101,81 @@ private:
         }
     }
 
+    // 辅助函数：解析渲染路径 (缺省为前向渲染)、深度预渲染开关与阴影算法 (缺省为 PCSS)
+    static void parse_render_options(const json& cfg, Scene& scene) {
+        std::string path = cfg.value("render_path", "forward");
+        if(path == "deferred") {
+            scene.set_render_path(RenderPath::Deferred);
+        } else {
+            if(path != "forward") std::cerr << "Unknown render path '" << path << "', fallback to forward." << std::endl;
+            scene.set_render_path(RenderPath::Forward);
+            path = "forward";
+        }
+        std::cout << "Render path: " << path << std::endl;
+
+        bool prepass = cfg.value("depth_prepass", false);
+        scene.set_depth_prepass(prepass);
+        if(prepass) std::cout << "Depth pre-pass: enabled" << std::endl;
+
+        std::string shadow = cfg.value("shadow", "pcss");
+        if(shadow == "hard") {
+            scene.set_shadow_filter(ShadowFilter::Hard);
+        } else if(shadow == "vsm") {
+            scene.set_shadow_filter(ShadowFilter::VSM);
+            scene.set_shadow_blur_radius(cfg.value("shadow_blur", 2));
+        } else {
+            if(shadow != "pcss") std::cerr << "Unknown shadow filter '" << shadow << "', fallback to pcss." << std::endl;
+            scene.set_shadow_filter(ShadowFilter::PCSS);
+            shadow = "pcss";
+        }
+        std::cout << "Shadow filter: " << shadow << std::endl;
+    }
+
+    // 辅助函数：解析纹理过滤方式 (缺省为三线性)、texel 排布 (缺省逐行) 与块压缩 (缺省不压缩)，需在加载纹理之前调用
+    static void parse_texture_options(const json& cfg, std::unique_ptr<TextureManager>& texMgr) {
+        std::string filter = cfg.value("texture_filter", "trilinear");
+        if(filter == "nearest") {
+            texMgr->set_filter(Interpolation::NEAREST);
+        } else if(filter == "bilinear") {
+            texMgr->set_filter(Interpolation::BILINEAR);
+        } else if(filter == "anisotropic") {
+            int aniso = std::clamp(cfg.value("max_anisotropy", 8), 1, 16);
+            texMgr->set_filter(Interpolation::ANISOTROPIC, aniso);
+            filter += " x" + std::to_string(aniso);
+        } else {
+            if(filter != "trilinear") std::cerr << "Unknown texture filter '" << filter << "', fallback to trilinear." << std::endl;
+            texMgr->set_filter(Interpolation::TRILINEAR);
+            filter = "trilinear";
+        }
+        std::cout << "Texture filter: " << filter << std::endl;
+
+        std::string layout = cfg.value("texture_layout", "linear");
+        if(layout == "tiled") {
+            texMgr->set_layout(TexelLayout::TILED);
+        } else if(layout == "morton") {
+            texMgr->set_layout(TexelLayout::MORTON);
+        } else {
+            if(layout != "linear") std::cerr << "Unknown texture layout '" << layout << "', fallback to linear." << std::endl;
+            texMgr->set_layout(TexelLayout::LINEAR);
+            layout = "linear";
+        }
+        std::cout << "Texture layout: " << layout << std::endl;
+
+        // "bc" 按用途压缩为 BC1/BC3/BC5，此时 texture_layout 不再生效
+        std::string compression = cfg.value("texture_compression", "none");
+        if(compression != "bc" && compression != "none") {
+            std::cerr << "Unknown texture compression '" << compression << "', fallback to none." << std::endl;
+            compression = "none";
+        }
+        texMgr->set_compression(compression == "bc");
+        std::cout << "Texture compression: " << compression << std::endl;
+    }
+
     // 辅助函数：加载单个网格
     static void load_single_mesh(const json& mesh_cfg, const std::string& base_path, int model_id,
-                          std::unique_ptr<ModelManager>& modelMgr, std::unique_ptr<MaterialManager>& matMgr, std::unique_ptr<TextureManager>& texMgr) {
-        /* 加载几何数据 */
+                          std::unique_ptr<ModelManager>& modelMgr, std::unique_ptr<MaterialManager>& matMgr, std::unique_ptr<TextureManager>& texMgr,
+                          std::vector<int>& blend_from_alpha) {
         std::string obj_path = base_path + mesh_cfg.value("filename", "");
-        Mesh& mesh = modelMgr->load_obj_to_model(model_id, obj_path);
 
         /* 解析材质 */
         assert(mesh_cfg.contains("material") && mesh_cfg["material"].is_object());
@@ -135,14 +208,23 @@ private:
         if(mtl.features & Material::USE_DIFFUSE_MAP) 
             mtl.diffuse_tex_id = texMgr->load_texture(choose_tex("_diffuse"));
         if(mtl.features & Material::USE_NORMAL_MAP) 
-            mtl.normal_tex_id = texMgr->load_texture(choose_tex("_nm"));
+            mtl.normal_tex_id = texMgr->load_texture(choose_tex("_nm"), TextureUsage::DATA);
         if(mtl.features & Material::USE_SPECULAR_MAP) 
-            mtl.specular_tex_id = texMgr->load_texture(choose_tex("_spec"));
+            mtl.specular_tex_id = texMgr->load_texture(choose_tex("_spec"), TextureUsage::DATA);
         if(mtl.features & Material::USE_NM_TANGENT_MAP) 
-            mtl.nm_tangent_tex_id = texMgr->load_texture(choose_tex("_nm_tangent"));
+            mtl.nm_tangent_tex_id = texMgr->load_texture(choose_tex("_nm_tangent"), TextureUsage::TANGENT_NORMAL);
+
+        /* 混合模式：优先读取配置，否则带 Alpha 通道的漫反射贴图视为需要混合，待纹理加载完成后再确定 */
+        if(mat_json.contains("blend"))
+            mtl.alpha_blend = mat_json["blend"];
 
         /* 绑定材质 */
         int mtl_id = matMgr->add_material(mtl);
+        if(!mat_json.contains("blend") && mtl.diffuse_tex_id >= 0)
+            blend_from_alpha.push_back(mtl_id);
+
+        /* 加载几何数据，与后台的纹理解码同时进行 */
+        Mesh& mesh = modelMgr->load_obj_to_model(model_id, obj_path);
         mesh.material_id = mtl_id;
         mesh.name = obj_path.substr(obj_path.find_last_of('/') + 1, obj_path.find_last_of('.') - obj_path.find_last_of('/') - 1);                        
     }
@@ -153,6 +235,7 @@ private:
                                       std::unique_ptr<TextureManager>& texMgr, std::unique_ptr<MaterialManager>& matMgr,
                                       std::unique_ptr<ModelManager>& modelMgr, std::unique_ptr<EntityManager>& entityMgr) {
         std::unordered_map<std::string, int> ref_to_id;
+        std::vector<int> blend_from_alpha; // 由漫反射贴图的 Alpha 通道决定混合模式的材质
 
         /* 解析模型 */
         if(cfg.contains("models") && cfg["models"].is_object()) {
@@ -163,7 +246,7 @@ private:
                 std::string base_path = m_info.value("path", "");
                 if(m_info.contains("mesh") && m_info["mesh"].is_object()) {
                     for(auto& [mesh_name, mesh_cfg] : m_info["mesh"].items()) {
-                        load_single_mesh(mesh_cfg, base_path, model_id, modelMgr, matMgr, texMgr);
+                        load_single_mesh(mesh_cfg, base_path, model_id, modelMgr, matMgr, texMgr, blend_from_alpha);
                     }
                 }
                 modelMgr->get_model(model_id)->align_to_bottom();
@@ -176,6 +259,13 @@ private:
             exit(-1);
         }
 
+        /* 等待纹理加载完成 */
+        texMgr->wait_all();
+        for(int mtl_id : blend_from_alpha) {
+            Material* mtl = matMgr->get_material(mtl_id);
+            mtl->alpha_blend = texMgr->get_texture(mtl->diffuse_tex_id)->has_alpha();
+        }
+
         /* 解析实例 */
         auto process_entity = [&](const std::string& name, const json& e_cfg) {
             std::string ref = e_cfg.value("ref", "");
@@ -206,6 +296,18 @@ private:
             Light light;
             light.position = {l_cfg["pos"][0], l_cfg["pos"][1], l_cfg["pos"][2]};
             light.intensity = {l_cfg["intensity"][0], l_cfg["intensity"][1], l_cfg["intensity"][2]};
+            light.shadow_size = std::max(1, l_cfg.value("shadow_resolution", sm_default_size));
+            light.cascades = std::clamp(l_cfg.value("cascades", 1), 1, sm_max_cascades);
+
+            std::string format = l_cfg.value("shadow_format", "float");
+            if(format == "unorm16") {
+                light.shadow_format = DepthFormat::Unorm16;
+            } else if(format == "unorm24") {
+                light.shadow_format = DepthFormat::Unorm24;
+            } else {
+                if(format != "float") std::cerr << "Unknown shadow format '" << format << "', fallback to float." << std::endl;
+                light.shadow_format = DepthFormat::Float32;
+            }
             scene.add_light(light);
         };
 
@@ -2,10 +2,21 @@
 #include <vector>
 #include <string>
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <tuple>
 #include "geometry.h"
 #include "global.h"
 #include "texture.h"
 
+/* 一个面角引用的顶点属性索引组合 (vrt, uv, nrm) */
+struct VertexIndex {
+    int vrt, uv, nrm;
+    bool operator<(const VertexIndex& o) const {
+        return std::tie(vrt, uv, nrm) < std::tie(o.vrt, o.uv, o.nrm);
+    }
+};
+
 struct Mesh {
     std::string name;
     int material_id = -1; // decouple mesh and material
@@ -20,6 +31,10 @@ struct Mesh {
     std::vector<std::array<int, 3>> facet_uv; // per-triangle uv indice
     
     std::vector<vec3> tangents; // per-vertex tangents
+
+    /* 后变换顶点缓存：几何阶段只对去重后的 (vrt, uv, nrm) 组合做一次顶点着色 */
+    std::vector<VertexIndex> vertex_indices;           // unique (vrt, uv, nrm) tuples
+    std::vector<std::array<int, 3>> facet_vertex;      // per-triangle index in the above array
 };
 
 class Model {
@@ -37,6 +52,10 @@ public:
 
     void add_mesh(const Mesh& m) { meshes.push_back(std::move(m)); }
     void align_to_bottom();
+
+    // 模型空间的包围盒
+    vec3 get_min_pos() const { return min_pos; }
+    vec3 get_max_pos() const { return max_pos; }
 };
 
 class ModelManager {
@@ -58,15 +77,25 @@ friend class EntityManager;
 private:
     int model_id;      // 指向 ModelManager 中的 ID
     vec3 pos, rot, scl; // 每个实例特有的变换属性
+
+    // 修订号：实体每次变化都取一个全局唯一的新值，阴影贴图缓存据此判断是否需要重绘
+    uint64_t revision = next_revision();
+    static uint64_t next_revision() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
 public:
     Entity(int m_id) : model_id(m_id), pos(0, 0, 0), rot(0, 0, 0), scl(1, 1, 1) {}
     
-    Entity& set_pos(const vec3& p) { pos = p; return *this; }
-    Entity& set_rot(const vec3& r) { rot = r; return *this; }
-    Entity& set_scale(const vec3& s) { scl = s; return *this; }
+    Entity& set_pos(const vec3& p) { pos = p; mark_dirty(); return *this; }
+    Entity& set_rot(const vec3& r) { rot = r; mark_dirty(); return *this; }
+    Entity& set_scale(const vec3& s) { scl = s; mark_dirty(); return *this; }
+    // 变换以外的改动 (如替换了网格数据) 需要手动标记
+    void mark_dirty() { revision = next_revision(); }
 
     mat4 get_matrix() const;
     int get_model_id() const { return model_id; }
+    uint64_t get_revision() const { return revision; }
 };
 
 class EntityManager {
@@ -0,0 +1,91 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include "geometry.h"
+
+/* 顶点与采样点吸附到 1/256 像素的网格上，覆盖测试用整数精确进行 */
+constexpr int SUBPIXEL_BITS = 8;
+constexpr int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+/* 边函数 E(x, y) = a * x + b * y + c，同样可以用来表示屏幕空间中线性变化的属性 */
+struct EdgeFunction {
+    float a = 0, b = 0, c = 0;
+
+    EdgeFunction() = default;
+    EdgeFunction(float a, float b, float c) : a(a), b(b), c(c) {}
+    // 由有向边 (v1, v2) 构建，E(p) = scale * signed_triangle_area(p, v1, v2)
+    EdgeFunction(const vec4& v1, const vec4& v2, float scale) 
+        : a(0.5f * (v1.y - v2.y) * scale), b(0.5f * (v2.x - v1.x) * scale), c(0.5f * (v1.x * v2.y - v1.y * v2.x) * scale) {}
+
+    float evaluate(float x, float y) const { return a * x + b * y + c; }
+    float offset(float dx, float dy) const { return a * dx + b * dy; }
+    // 在 [x, x + size] x [y, y + size] 内能取到的最大值，用于整块剔除
+    float max_in_block(float x, float y, float size) const {
+        return evaluate(x, y) + (std::max(a, 0.f) + std::max(b, 0.f)) * size;
+    }
+
+    // 以三个重心坐标边函数为基，对顶点属性做屏幕空间线性组合
+    static EdgeFunction combine(const EdgeFunction (&e)[3], float f0, float f1, float f2) {
+        return {e[0].a * f0 + e[1].a * f1 + e[2].a * f2,
+                e[0].b * f0 + e[1].b * f1 + e[2].b * f2,
+                e[0].c * f0 + e[1].c * f1 + e[2].c * f2};
+    }
+};
+
+/* 定点数边函数，坐标以子像素为单位，E(p) 为 p 与有向边 (v1, v2) 围成的有向面积的两倍
+ * 保护带内的坐标不超过 2^22，各项乘积不超过 2^46，用 int64 求值不会溢出
+ * 左上填充规则：不是上边或左边的边排除 E = 0 的采样点，这一偏置已折算进 c，
+ * 因此覆盖测试统一为 E >= 0，共享边上的采样点恰好属于其中一个三角形 */
+struct FixedEdge {
+    int64_t a = 0, b = 0, c = 0;
+
+    FixedEdge() = default;
+    FixedEdge(int64_t x1, int64_t y1, int64_t x2, int64_t y2)
+        : a(y1 - y2), b(x2 - x1), c(x1 * y2 - y1 * x2) {
+        // 逆时针三角形的内部在有向边左侧：a > 0 为左边，a = 0 且 b < 0 为上边
+        bool top_left = a > 0 || (a == 0 && b < 0);
+        if(!top_left) c -= 1;
+    }
+
+    int64_t evaluate(int64_t px, int64_t py) const { return a * px + b * py + c; }
+    // 在 [px, px + size] x [py, py + size] 内能取到的最大值，用于整块剔除
+    int64_t max_in_block(int64_t px, int64_t py, int64_t size) const {
+        return evaluate(px, py) + (std::max<int64_t>(a, 0) + std::max<int64_t>(b, 0)) * size;
+    }
+};
+
+/* 三角形建立 (Triangle Setup) 的结果，每个三角形只计算一次 */
+struct TriangleSetup {
+    FixedEdge coverage[3];   // 覆盖测试用的定点数边函数
+    EdgeFunction edges[3];   // alpha, beta, gamma 三个重心坐标
+    EdgeFunction z, inv_w;   // 屏幕空间线性的 z 与 1 / w
+    float inv_w1, inv_w2, inv_w3;
+};
+
+/* 一个内核调用同时处理同一行中连续 8 个像素的同一个子采样点 */
+constexpr int SIMD_LANES = 8;
+
+/* 内核输出：通过测试的 lane 的透视矫正重心坐标与深度 */
+struct LanePacket {
+    alignas(32) float alpha[SIMD_LANES];
+    alignas(32) float beta[SIMD_LANES];
+    alignas(32) float gamma[SIMD_LANES];
+    alignas(32) float z[SIMD_LANES];
+};
+
+/* 深度测试函数 (反向 Z：越大越近) */
+enum class DepthFunc {
+    Greater,      // 常规测试：比缓冲中的深度更近才通过
+    GreaterEqual  // 深度预渲染之后的着色：缓冲中已是最近的深度，相等即通过
+};
+
+/* 覆盖测试 + 深度测试 + 透视矫正，返回通过全部测试的 lane 掩码
+ * (px, py):  lane 0 的采样点坐标，以子像素为单位，lane i 的采样点为 (px + i * SUBPIXEL_ONE, py)
+ * depth:     lane 0 对应的深度缓冲地址，lane i 对应 depth[i * stride]
+ * lane_mask: 需要处理的 lane，只有这些 lane 会读取深度缓冲
+ */
+using RasterKernel = int (*)(const TriangleSetup& s, int px, int py, const float* depth, int stride, int lane_mask, DepthFunc func, LanePacket& out);
+
+/* 运行时根据 CPU 特性选择 AVX2 / SSE / 标量实现 */
+RasterKernel get_raster_kernel();
+const char* get_raster_kernel_name();
@@ -6,6 +6,7 @@
 #include "model.h"
 #include "scene.h"
 #include "shader.h"
+#include "raster_kernel.h"
 
 enum class Buffers {
     Color = 1 << 0,
@@ -23,9 +24,131 @@ const int TILE_SIZE = 32;
 const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
 const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
 
+/* Tile 内部的层次化遍历：8x8 块 -> 4x4 子块 -> 像素 */
+const int BLOCK_SIZE = 8;
+const int SUB_BLOCK_SIZE = 4;
+
+/* 阴影贴图同样分 Tile 并行光栅化 */
+const int SHADOW_TILE_SIZE = 128;
+
+/* 阴影贴图拟合：光源视锥在切平面 (x/z, y/z) 上向外扩展的量，为 PCSS 等滤波核留出余量
+ * (90° 基准投影下最大的 uv 半径 0.02 对应切平面上的 0.04) */
+const float SHADOW_FIT_PADDING = 0.05f;
+/* 级联划分：对数划分与均匀划分的混合系数 */
+const float CASCADE_SPLIT_LAMBDA = 0.75f;
+
+/* 单个像素允许的最大子采样数 (SSAA 4x4) */
+const int MAX_SAMPLES = 16;
+
+/* 保护带：屏幕坐标在 [-GUARD_BAND, 尺寸 + GUARD_BAND] 内的三角形不在 x/y 方向上裁剪，
+ * 交给包围盒与边函数处理；超出这一范围 (光栅化的定点数可能溢出) 时才裁剪 */
+constexpr float GUARD_BAND = 8192.f;
+
+/* 一个三角形经近平面与保护带裁剪后最多得到的顶点数 (3 + 5 个裁剪平面) */
+const int MAX_CLIP_VERTICES = 8;
+
+/* Hi-Z 剔除时为深度平面求值的浮点舍入留出的余量 */
+const float HIZ_EPSILON = 1e-5f;
+
+/* Tile 命令列表中的一项：三角形及其所属的绘制调用 */
+struct TileCommand {
+    int triangle; // 在所属 BinSet::triangles 中的索引
+    int draw;     // 在 draw_commands 中的索引
+};
+
 struct Tile {
     int x_start, y_start;
-    std::vector<int> triangle_indices; // 该 Tile 覆盖的三角形索引
+};
+
+/* draw_triangle 的工作方式 */
+enum class RasterPass {
+    Color,      // 深度测试后着色，或写入 G-Buffer
+    DepthOnly,  // 深度预渲染：只写深度
+    ColorEqual  // 深度预渲染之后的着色：深度相等才着色
+};
+
+/* 一次绘制调用 (实体 x 网格) 的全部状态 */
+struct DrawCommand {
+    IShader* shader;
+    ShaderContext context;
+    const Mesh* mesh;
+    int first_vertex; // 在整帧顶点缓存中的起始位置
+    int first_face;   // 在整帧面片序列中的起始位置
+    bool deferred;      // 是否走延迟渲染路径
+    bool depth_prepass; // 是否参与深度预渲染 (着色时改用相等测试)
+};
+
+/* G-Buffer 只携带这些插值属性，需要其它属性的着色器仍走前向渲染 */
+const int GBUFFER_VARYINGS = VARYING_WORLD_POS | VARYING_UV | VARYING_NORMAL | VARYING_TANGENT;
+
+/* G-Buffer 中的一个子采样，深度仍然保存在 zbuffer 中 */
+struct GBufferSample {
+    vec3 world_pos;
+    vec2 uv;
+    vec2 uv_dx, uv_dy; // uv 的屏幕空间导数，光照 Pass 据此选择 mip 层级
+    uint32_t normal;  // 八面体编码，两个 16 位分量
+    uint32_t tangent; // 同上
+    int draw;         // 所属绘制调用 (决定材质、着色器与上下文)，-1 表示没有被覆盖
+    int primitive;    // Tile 内的图元序号，MSAA 下同一像素同一图元的子采样只做一次光照
+};
+
+/* 驻留在单个 Tile 内的 G-Buffer，每个光栅化线程一份 */
+struct GBufferTile {
+    std::vector<GBufferSample> samples; // 下标 ((x - x_start) + (y - y_start) * TILE_SIZE) * 子采样数 + k
+    int primitive_count = 0;
+};
+
+/* 阴影贴图缓存的键：全部实体的修订号与拟合出的各级联投影都不变时，上一帧的深度图仍然有效
+ * 投影由光源位置、阴影贴图设置、场景包围盒与相机视锥共同决定 */
+struct ShadowCacheKey {
+    std::vector<std::pair<const Entity*, uint64_t>> entities;
+    std::vector<mat4> light_vps;
+    int shadow_size = 0;
+    DepthFormat shadow_format = DepthFormat::Float32;
+
+    bool operator==(const ShadowCacheKey& o) const {
+        if(shadow_size != o.shadow_size || shadow_format != o.shadow_format || entities != o.entities || light_vps.size() != o.light_vps.size()) return false;
+        for(int i = 0; i < light_vps.size(); i++) {
+            for(int r = 0; r < 4; r++) {
+                for(int c = 0; c < 4; c++) {
+                    if(light_vps[i][r][c] != o.light_vps[i][r][c]) return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+/* 一张阴影贴图的深度 Pass：光源视角的上下文副本，以及变换到阴影贴图空间、按 Tile 装箱的三角形 */
+struct ShadowMapPass {
+    ShaderContext context;
+    std::vector<std::array<vec4, 3>> triangles;
+    std::vector<std::vector<int>> tile_triangles; // 按阴影贴图的 Tile 索引
+    int tiles_x = 0, tiles_y = 0;
+};
+
+/* 一个光源的深度 Pass，每个级联一张贴图 */
+struct ShadowPass {
+    std::vector<ShadowMapPass> maps;
+
+    bool cached = false; // 深度图是否按 key 渲染过且仍然有效
+    ShadowCacheKey key;
+};
+
+/* 经过几何阶段处理、等待光栅化的三角形 */
+struct TriangleCache {
+    Triangle t;
+    TriangleSetup setup;
+    vec2 min_xy, max_xy;
+    float max_z; // 顶点中最近的深度 (反向 Z)，用于由近及远排序
+};
+
+/* 几何阶段中每个线程独占的装箱结果
+ * 线程 t 处理整帧面片序列中连续的第 t 段，因此光栅化时按线程序号依次遍历各自的命令列表，
+ * 就能在无锁的前提下保持每个 Tile 内三角形的提交顺序 */
+struct BinSet {
+    std::vector<TriangleCache> triangles;
+    std::vector<std::vector<TileCommand>> tile_commands; // 按 Tile 索引
 };
 
 class Rasterizer {
@@ -34,12 +157,44 @@ private:
 
     /* 渲染参数 */
     int width, height;
-    int ssaa = 1;
+    int ssaa = 1;     // 每个像素在 x/y 方向上的子采样数
+    bool msaa = false; // 为 true 时每像素每三角形只着色一次，颜色写入所有被覆盖的子采样
     std::vector<vec4> framebuffer;
     std::vector<float> zbuffer;
 
+    RasterKernel raster_kernel = get_raster_kernel(); // 按 CPU 特性选择的像素内核
+
+    /* Hi-Z: 每个 Tile 与每个 8x8 块内全部子采样中最远的深度 (反向 Z 下即最小值)
+     * 深度只会被更近的值覆盖，过期的值仍是保守的下界，因此块只在被查询时按需刷新 */
+    int blocks_x = 0, blocks_y = 0;
+    std::vector<float> hiz_blocks;
+    std::vector<uint8_t> hiz_dirty;
+    std::vector<float> hiz_tiles;
+
     ShaderContext context; // 渲染上下文
     IShader* currentShader; // 当前Shader类型
+
+    /* Sort-Middle: 整帧的三角形先全部变换、装箱，再逐 Tile 光栅化一次 */
+    std::vector<DrawCommand> draw_commands;
+    std::vector<Vertex> frame_vertices; // 后变换顶点缓存，按绘制调用分段
+    std::vector<BinSet> bin_sets; // 每个几何线程一份
+    int geometry_threads = 0;     // 本帧实际参与几何阶段的线程数
+
+    /* 延迟渲染 */
+    RenderPath render_path = RenderPath::Forward;
+    bool has_deferred_draws = false;  // 本帧是否有绘制调用走延迟路径
+    std::vector<GBufferTile> gbuffers; // 每个光栅化线程一份
+
+    /* 深度预渲染 */
+    bool depth_prepass = false;
+    bool has_prepass_draws = false;
+
+    /* 阴影数据 */
+    std::vector<LightShadowMaps> shadow_datas; // 按光源索引
+    std::vector<ShadowPass> shadow_passes;     // 与 shadow_datas 一一对应，跨帧复用
+    std::unique_ptr<IShadowStrategy> shadow_strategy;
+    ShadowFilter shadow_filter = ShadowFilter::PCSS; // shadow_strategy 对应的场景设置
+    int shadow_blur_radius = 0;
     
     /* 资源管理池 */
     ModelManager* modelMgr = nullptr;
@@ -57,17 +212,31 @@ public:
             tiles[i].x_start = (i % tiles_x) * TILE_SIZE;
             tiles[i].y_start = (i / tiles_x) * TILE_SIZE;
         }
+
+        blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        hiz_blocks.resize(blocks_x * blocks_y);
+        hiz_dirty.resize(blocks_x * blocks_y);
+        hiz_tiles.resize(tiles.size());
+        reset_hiz();
     }
     ~Rasterizer() = default;
 
     void draw(const Scene& scene);
+    // 丢弃缓存的阴影贴图，下一帧全部重绘 (光源与实体的变化会被自动检测，这里用于其它外部改动)
+    void invalidate_shadow_maps() {
+        for(auto& pass : shadow_passes) pass.cached = false;
+    }
     
     TGAImage to_tga_image(Buffers buffer);
     void save_as(const std::string& filename);
     void save_zbuffer_as(const std::string& filename);
     void clear(Buffers buffer) {
         if((buffer & Buffers::Color) == Buffers::Color) std::fill(framebuffer.begin(), framebuffer.end(), vec4(0, 0, 0, 1.f));
-        if((buffer & Buffers::Depth) == Buffers::Depth) std::fill(zbuffer.begin(), zbuffer.end(), 0);
+        if((buffer & Buffers::Depth) == Buffers::Depth) {
+            std::fill(zbuffer.begin(), zbuffer.end(), 0);
+            reset_hiz();
+        }
     }
     
     void set_depth(const int& ind, const float& z) { zbuffer[ind] = z; }
@@ -99,9 +268,17 @@ public:
     std::vector<float>& get_zbuffer() { return zbuffer; }
     
     void enable_ssaa(const int& ssaa) { 
+        assert(ssaa * ssaa <= MAX_SAMPLES);
         this->ssaa = ssaa;
+        this->msaa = false;
         framebuffer.resize(width * height * ssaa * ssaa, vec4(0, 0, 0, 1.f));
         zbuffer.resize(width * height * ssaa * ssaa);
+        reset_hiz();
+    }
+    // 与 SSAA 使用相同的子采样布局与 Resolve，只是片段着色降为逐像素
+    void enable_msaa(const int& ssaa) {
+        enable_ssaa(ssaa);
+        this->msaa = true;
     }
 private:
     /* 把绘制过程划分成更具体的层次，
@@ -109,15 +286,32 @@ private:
      * 2. 绘制三角形
      * 3. 绘制网格
      * 4. 绘制实体
+     * 5. 按 Tile 光栅化整帧 (延迟路径下先写 G-Buffer，再逐子采样光照)
      */
     void draw_line(vec2 v1, vec2 v2, TGAColor color);
-    void draw_triangle(const Triangle& triangle, const vec2& tri_min, const vec2& tri_max, const Tile& tile);
-    void draw_mesh(const Mesh& mesh);
+    void draw_triangle(const TriangleCache& tri, const Tile& tile, int draw_id, RasterPass pass, GBufferTile* gbuffer);
+    void shade_vertices(int draw_id, int vertex_begin, int vertex_end);
+    void draw_mesh(int draw_id, int face_begin, int face_end, BinSet& bins);
+    void bin_triangle(int draw_id, std::array<Vertex, 3>& verts, BinSet& bins);
     void draw_entity(const Entity* e);
+    void process_geometry();
+    void rasterize_tiles();
+    void shade_gbuffer(const Tile& tile, GBufferTile& gbuffer);
+
+    /* Hi-Z 维护 */
+    void reset_hiz() {
+        // 0 是任何深度的下界；标记为脏后首次查询时再从 zbuffer 精确计算
+        std::fill(hiz_blocks.begin(), hiz_blocks.end(), 0.f);
+        std::fill(hiz_dirty.begin(), hiz_dirty.end(), 1);
+        std::fill(hiz_tiles.begin(), hiz_tiles.end(), 0.f);
+    }
+    float hiz_block_depth(int block);
 
     /* 阴影贴图渲染 */
     void render_shadow_maps(const Scene& scene);
-    void execute_depth_pass(const Scene& scene, ShadowMapData& sd);
-    void draw_mesh_depth_only(const Mesh& mesh, std::vector<float>& depth_buffer);
-    void draw_triangle_depth(const std::array<vec4, 3>& v, std::vector<float>& shadow_buffer);
+    // 按场景包围盒与相机视锥为光源拟合各级联的投影，返回只填好投影参数的贴图
+    LightShadowMaps fit_shadow_maps(const Scene& scene, const Light& light);
+    void draw_mesh_depth_only(const Mesh& mesh, const ShadowMapData& sd, std::vector<std::array<vec4, 3>>& triangles);
+    template<DepthFormat F>
+    void draw_triangle_depth(const std::array<vec4, 3>& v, ShadowMapData& sd, const Tile& tile);
 };
\ No newline at end of file
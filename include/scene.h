@@ -6,16 +6,41 @@
 #include "camera.h"
 #include "shader.h"
 
+/* 场景使用的渲染路径 */
+enum class RenderPath {
+    Forward,  // 每个片段光栅化后立即着色
+    Deferred  // 先写入 G-Buffer，每个可见子采样只做一次光照
+};
+
+/* 场景使用的阴影算法 */
+enum class ShadowFilter {
+    Hard, // 单次采样的硬阴影
+    PCSS, // 逐片段搜索遮挡物并滤波的软阴影
+    VSM   // 预滤波的方差阴影贴图
+};
+
 class Scene {
 private:
+    RenderPath renderPath = RenderPath::Forward;
+    bool depthPrepass = false; // 前向渲染前先做一遍只写深度的预渲染
+    ShadowFilter shadowFilter = ShadowFilter::PCSS;
+    int shadowBlurRadius = 2;  // 预滤波类阴影的模糊半径 (阴影贴图像素)
     Camera activeCamera;
     std::vector<Light> lights;
     std::vector<Entity*> entities;
 public:
+    void set_render_path(RenderPath p) { renderPath = p; }
+    void set_depth_prepass(bool enable) { depthPrepass = enable; }
+    void set_shadow_filter(ShadowFilter f) { shadowFilter = f; }
+    void set_shadow_blur_radius(int r) { shadowBlurRadius = r; }
     void set_camera(const Camera& c) { activeCamera = c; }
     void add_light(const Light& l) { lights.push_back(std::move(l)); }
     void add_entity(Entity* e) { entities.push_back(std::move(e)); }
     
+    RenderPath get_render_path() const { return renderPath; }
+    bool get_depth_prepass() const { return depthPrepass; }
+    ShadowFilter get_shadow_filter() const { return shadowFilter; }
+    int get_shadow_blur_radius() const { return shadowBlurRadius; }
     Camera& get_camera() { return activeCamera; }
     const Camera& get_camera() const { return activeCamera; }
     const std::vector<Light>& get_lights() const { return lights; }
@@ -2,11 +2,13 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <utility>
 #include "geometry.h"
 #include "triangle.h"
 #include "model.h"
 #include "light.h"
 #include "global.h"
+#include "depth_format.h"
 
 /* 定义Vertex类 */
 struct Vertex {
@@ -19,31 +21,136 @@ struct Vertex {
     vec3 tangent;
     vec3 bitangent;
     vec3 normal;
-    
-    // 静态辅助接口：对 Vertex 属性进行插值
+};
+
+/* 片段着色器声明需要的插值属性 (varying)，光栅化器只插值被声明的属性 */
+enum Varying {
+    VARYING_WORLD_POS = 1 << 0,
+    VARYING_COLOR     = 1 << 1,
+    VARYING_UV        = 1 << 2,
+    VARYING_NORMAL    = 1 << 3,
+    VARYING_TANGENT   = 1 << 4,
+    VARYING_BITANGENT = 1 << 5
+};
+
+constexpr int FRAGMENT_PACKET_SIZE = 8;
+
+/* 定义FragmentPacket结构体，以 SoA 形式存放一批片段，片段着色器每批只调用一次
+ * 未在 varyings() 中声明的属性数组内容未定义 */
+struct FragmentPacket {
+    static constexpr int N = FRAGMENT_PACKET_SIZE;
+    int count = 0;
+
+    /* 输入：重心坐标与插值后的属性 */
+    alignas(32) float alpha[N], beta[N], gamma[N];
+    alignas(32) float world_pos[3][N];
+    alignas(32) float color[3][N];
+    alignas(32) float uv[2][N];
+    alignas(32) float uv_dx[2][N], uv_dy[2][N]; // uv 在屏幕 x/y 方向上的导数，随 VARYING_UV 一起由光栅化器给出，用于选择 mip 层级
+    alignas(32) float normal[3][N];
+    alignas(32) float tangent[3][N];
+    alignas(32) float bitangent[3][N];
+
+    /* 输出：第 i 位为 1 表示第 i 个片段被丢弃 */
+    vec4 rgba[N];
+    int discard_mask = 0;
+
+    vec3 get_world_pos(int i) const { return vec3(world_pos[0][i], world_pos[1][i], world_pos[2][i]); }
+    vec3 get_color(int i)     const { return vec3(color[0][i], color[1][i], color[2][i]); }
+    vec2 get_uv(int i)        const { return vec2(uv[0][i], uv[1][i]); }
+    vec2 get_uv_dx(int i)     const { return vec2(uv_dx[0][i], uv_dx[1][i]); }
+    vec2 get_uv_dy(int i)     const { return vec2(uv_dy[0][i], uv_dy[1][i]); }
+    vec3 get_normal(int i)    const { return vec3(normal[0][i], normal[1][i], normal[2][i]); }
+    vec3 get_tangent(int i)   const { return vec3(tangent[0][i], tangent[1][i], tangent[2][i]); }
+    vec3 get_bitangent(int i) const { return vec3(bitangent[0][i], bitangent[1][i], bitangent[2][i]); }
+
+    // 按 varyings 掩码插值三角形的顶点属性，法线与切线空间基向量插值后归一化
     // 注意：pos 比较特殊，不在这里做插值
-    static Vertex lerp(float alpha, float beta, float gamma, const Triangle& t) {
-        Vertex v;
+    void interpolate(const Triangle& t, int varyings) {
+        if(varyings & VARYING_WORLD_POS) lerp_attribute<3>(world_pos, t.world_pos);
+        if(varyings & VARYING_COLOR)     lerp_attribute<3>(color, t.color);
+        if(varyings & VARYING_UV)        lerp_attribute<2>(uv, t.tex_coord);
+        if(varyings & VARYING_NORMAL)    { lerp_attribute<3>(normal, t.normal); normalize_attribute(normal); }
+        if(varyings & VARYING_TANGENT)   { lerp_attribute<3>(tangent, t.tangent); normalize_attribute(tangent); }
+        if(varyings & VARYING_BITANGENT) { lerp_attribute<3>(bitangent, t.bitangent); normalize_attribute(bitangent); }
+    }
 
-        v.color     = t.color[0] * alpha     + t.color[1] * beta     + t.color[2] * gamma;
-        v.uv        = t.tex_coord[0] * alpha + t.tex_coord[1] * beta + t.tex_coord[2] * gamma;
-        v.world_pos = t.world_pos[0] * alpha + t.world_pos[1] * beta + t.world_pos[2] * gamma;
-        v.normal    = (t.normal[0] * alpha   + t.normal[1] * beta    + t.normal[2] * gamma).normalized();
-        v.tangent   = (t.tangent[0] * alpha   + t.tangent[1] * beta   + t.tangent[2] * gamma).normalized();
-        v.bitangent = (t.bitangent[0] * alpha + t.bitangent[1] * beta + t.bitangent[2] * gamma).normalized();
+private:
+    template<int Dim, class V>
+    void lerp_attribute(float (&dst)[Dim][N], const V (&src)[3]) {
+        for(int c = 0; c < Dim; c++) {
+            const float a0 = src[0][c], a1 = src[1][c], a2 = src[2][c];
+            for(int i = 0; i < count; i++) {
+                dst[c][i] = a0 * alpha[i] + a1 * beta[i] + a2 * gamma[i];
+            }
+        }
+    }
 
-        return v;
+    // 与 vec3::normalized 保持一致：长度过小时置零
+    void normalize_attribute(float (&v)[3][N]) {
+        for(int i = 0; i < count; i++) {
+            float n = std::sqrt(v[0][i] * v[0][i] + v[1][i] * v[1][i] + v[2][i] * v[2][i]);
+            float inv_n = n < 1e-12 ? 0.f : 1.0f / n;
+            v[0][i] *= inv_n;
+            v[1][i] *= inv_n;
+            v[2][i] *= inv_n;
+        }
     }
 };
 
+/* 定义DepthRangeMip结构体，深度图 min/max 金字塔的一层，每个 texel 记录其覆盖区域内的深度范围 (x 为最小值，y 为最大值) */
+struct DepthRangeMip {
+    int width, height;
+    std::vector<vec2> range;
+};
+
 /* 定义ShadowMapData结构体，用于存储阴影贴图数据 */
 struct ShadowMapData {
-    std::vector<float> buffer; // 深度缓冲区
+    int width = 0, height = 0;
+    DepthFormat format = DepthFormat::Float32;
+    std::vector<uint8_t> buffer; // 深度缓冲区，按 format 编码，经 texels<F>() 访问
     mat4 light_vp;           // 光源 View-Projection 矩阵
+
+    template<DepthFormat F> typename DepthTraits<F>::Texel* texels() {
+        return reinterpret_cast<typename DepthTraits<F>::Texel*>(buffer.data());
+    }
+    template<DepthFormat F> const typename DepthTraits<F>::Texel* texels() const {
+        return reinterpret_cast<const typename DepthTraits<F>::Texel*>(buffer.data());
+    }
+    template<DepthFormat F> float depth(int idx) const { return DepthTraits<F>::decode(texels<F>()[idx]); }
+
+    /* 拟合出的光源投影参数 */
+    float z_near = zNear, z_far = zFar;
+    float filter_scale = 1.f; // 以 90° 投影为基准的 uv 半径换算到本贴图的比例，使滤波核的世界空间大小不随拟合变化
+    float split_far = zFar;   // 级联覆盖的最远视空间深度
+    std::vector<vec2> moments; // 预滤波后的深度矩，只有预滤波类的阴影策略会生成
+    std::vector<DepthRangeMip> depth_mips; // min/max 深度金字塔，第 i 层边长为原图的 1/2^(i+1)，直到 1x1
 };
 
+/* 一个光源的全部阴影贴图，级联由近及远排列，不分级联时只有一张 */
+using LightShadowMaps = std::vector<ShadowMapData>;
+
 class IShadowStrategy; // 前向声明阴影策略接口
 
+/* 定义DrawUniforms结构体，每次绘制调用只填充一次，着色器直接读取而无需重复计算或查询 */
+struct DrawUniforms {
+    mat4 model;
+    mat4 mvp;           // projection * view * model
+    mat4 normal_matrix; // model 的逆转置，用于变换法线
+
+    /* 材质参数 */
+    MaterialParameters params;
+    int features = 0;
+
+    /* 已解析的纹理，未启用的特性对应 nullptr */
+    const Texture* diffuse_map = nullptr;
+    const Texture* normal_map = nullptr;
+    const Texture* nm_tangent_map = nullptr;
+    const Texture* specular_map = nullptr;
+
+    bool has_feature(Material::Feature f) const { return features & f; }
+};
+
 /* 定义ShaderContext结构体，用于分离Shader的上下文和方法 */
 struct ShaderContext {
     /* 全局参数 */
@@ -52,141 +159,237 @@ struct ShaderContext {
     TextureManager* texMgr;
     const std::vector<Light>* lights;
 
-    /* 阴影贴图数据 */
-    std::vector<ShadowMapData> shadow_datas;
-    std::unique_ptr<IShadowStrategy> shadow_strategy; // 注入阴影算法
+    /* 阴影贴图数据，由 Rasterizer 持有，使上下文可以按绘制调用廉价复制 */
+    const std::vector<LightShadowMaps>* shadow_datas = nullptr;
+    IShadowStrategy* shadow_strategy = nullptr; // 注入阴影算法
 
     /* 模型参数 */
-    mat4 model;
-    const Material* mtl;
-
-    mat4 mvp; // projection * view * model
+    DrawUniforms uniforms;
 };
 
 /* 定义IShader抽象类 */
 class IShader {
 protected:
-    ShaderContext* context = nullptr;
+    // 与 OpenGL 一样，上下文绑定在当前线程上：各 Tile 可以并行地为不同绘制调用着色
+    static inline thread_local ShaderContext* context = nullptr;
     
-    vec4 get_diffuse_color(const vec2& uv) const;
-    vec3 get_specular_color(const vec2& uv) const;
+    // 是否采样贴图在编译期决定，由特化着色器按自身的特性掩码传入
+    template<bool UseMap> vec4 get_diffuse_color(const vec2& uv, const vec2& duv_dx, const vec2& duv_dy) const;
+    template<bool UseMap> vec3 get_specular_color(const vec2& uv, const vec2& duv_dx, const vec2& duv_dy) const;
     vec3 compute_lighting(const vec3& point, const vec3& normal, const vec3& diffuse_color, const vec3& specular_color, const vec3& ka, const vec3& kd, const vec3& ks, float p);
 public:
-    void bind_context(ShaderContext* ctx) { context = ctx; }
+    static void bind_context(ShaderContext* ctx) { context = ctx; }
 
-    virtual Vertex vertex(const Mesh& mesh, int iface, int nthvert) = 0;
-    virtual bool fragment(const Vertex& v, vec4& rgba) = 0;
+    // 逐顶点着色：每个唯一的 (vrt, uv, nrm) 组合每次绘制只调用一次
+    virtual Vertex vertex(const Mesh& mesh, const VertexIndex& idx) = 0;
+    // 逐面着色：三个顶点取自顶点缓存后调用，需要面信息的着色器 (如 FlatShader) 在这里修改属性
+    virtual void face(const Mesh& mesh, int iface, std::array<Vertex, 3>& verts) {}
+    // 片段着色需要插值的属性 (Varying 掩码)
+    virtual int varyings() const = 0;
+    // 逐批片段着色：一次处理 packet 中的全部片段，写入 rgba 与 discard_mask
+    virtual void fragment(FragmentPacket& packet) = 0;
 };
 
 /* 定义ShaderManager类 */
 class ShaderManager {
 private:
     std::unordered_map<std::string, std::unique_ptr<IShader>> shader_pool;
+    // 按材质特性掩码特化的着色器版本，下标即特性掩码
+    std::unordered_map<std::string, std::vector<std::unique_ptr<IShader>>> variant_pool;
+
+    template<template<int> class Shader, int... Features>
+    void register_variants(const std::string& name, std::integer_sequence<int, Features...>) {
+        auto& variants = variant_pool[name];
+        variants.clear();
+        (variants.push_back(std::make_unique<Shader<Features>>()), ...);
+    }
 public:
     void register_shader(const std::string& name, std::unique_ptr<IShader> s) {
         shader_pool[name] = std::move(s);
     }
 
+    // 为 Material::Feature 的每一种组合注册一个特化版本
+    template<template<int> class Shader>
+    void register_variants(const std::string& name) {
+        register_variants<Shader>(name, std::make_integer_sequence<int, Material::FEATURE_COMBINATIONS>{});
+    }
+
     IShader* get_shader(const std::string& name) {
         if (shader_pool.count(name)) {
             return shader_pool[name].get();
         }
         return nullptr;
     }
+
+    // 绑定材质时调用：优先返回与特性掩码匹配的特化版本，否则退回普通着色器
+    IShader* get_shader(const std::string& name, int features) {
+        auto it = variant_pool.find(name);
+        if (it != variant_pool.end()) {
+            assert(features >= 0 && features < (int)it->second.size());
+            return it->second[features].get();
+        }
+        return get_shader(name);
+    }
 };
 
 /* 定义FlatShader类 */
 class FlatShader : public IShader {
 private:
-    // Per-face logic to store face normal
-    int last_face_idx = -1;
-    vec3 face_normal;
-    vec3 face_point;
 public:
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    void face(const Mesh& mesh, int iface, std::array<Vertex, 3>& verts) override;
+    int varyings() const override { return VARYING_COLOR; }
+    void fragment(FragmentPacket& packet) override;
 };
 
 /* 定义GouraudShader类 */
 class GouraudShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    int varyings() const override { return VARYING_COLOR; }
+    void fragment(FragmentPacket& packet) override;
 };
 
 /* 定义PhongShader类 */
 class PhongShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    int varyings() const override { return VARYING_WORLD_POS | VARYING_NORMAL; }
+    void fragment(FragmentPacket& packet) override;
 };
 
 /* 定义NormalShader类 */
 class NormalShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    int varyings() const override { return VARYING_WORLD_POS | VARYING_UV; }
+    void fragment(FragmentPacket& packet) override;
 };
 
+/* 定义StandardShader类模板
+ * 按材质特性掩码在编译期特化，片段着色中没有运行时的特性分支 */
+template<int Features>
 class StandardShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+protected:
+    static constexpr bool use_diffuse_map = Features & Material::USE_DIFFUSE_MAP;
+    static constexpr bool use_normal_map = Features & Material::USE_NORMAL_MAP;
+    static constexpr bool use_specular_map = Features & Material::USE_SPECULAR_MAP;
+    static constexpr bool use_nm_tangent_map = Features & Material::USE_NM_TANGENT_MAP;
+
+    // 公共的光照计算，normal_offset 在切线空间贴图下偏移插值法线 (供 EyeShader 使用)
+    void shade(FragmentPacket& packet, const vec3& normal_offset);
+public:
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    int varyings() const override {
+        return VARYING_WORLD_POS | VARYING_UV | VARYING_NORMAL | (use_nm_tangent_map ? VARYING_TANGENT : 0);
+    }
+    void fragment(FragmentPacket& packet) override;
 };
 
 /* TODO: 还需要后续完善 EyeShader */
-class EyeShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+template<int Features>
+class EyeShader : public StandardShader<Features> {
+public:
+    void fragment(FragmentPacket& packet) override;
 };
 
 class DepthShader : public IShader {
-    Vertex vertex(const Mesh& mesh, int iface, int nthvert) override;
-    bool fragment(const Vertex& v, vec4& rgba) override;
+    Vertex vertex(const Mesh& mesh, const VertexIndex& idx) override;
+    int varyings() const override { return 0; }
+    void fragment(FragmentPacket& packet) override;
 };
 
 /* 定义IShadowStrategy抽象类，用于阴影计算 */
 class IShadowStrategy {
 protected:
-    float sample_buffer(const std::vector<float>& buffer, vec2 uv) {
-        int x = std::clamp((int)(uv.x * sm_width), 0, sm_width - 1);
-        int y = std::clamp((int)(uv.y * sm_height), 0, sm_height - 1);
-        float val = buffer[x + y * sm_width];
+    template<DepthFormat F>
+    float sample_buffer(const ShadowMapData& sd, vec2 uv) {
+        int x = std::clamp((int)(uv.x * sd.width), 0, sd.width - 1);
+        int y = std::clamp((int)(uv.y * sd.height), 0, sd.height - 1);
+        float val = sd.depth<F>(x + y * sd.width);
         return val;
     }
-    float sample_buffer_bilinear(const std::vector<float>& buffer, vec2 uv) {
-        float u = uv.x * (sm_width - 1);
-        float v = uv.y * (sm_height - 1);
+    // fetch(i) 返回 sd 中第 i 个 texel 的值 (解码后的深度或预滤波数据)
+    template<typename Fetch>
+    auto sample_buffer_bilinear(const ShadowMapData& sd, vec2 uv, Fetch fetch) {
+        using T = decltype(fetch(0));
+        float u = std::clamp(uv.x, 0.f, 1.f) * (sd.width - 1);
+        float v = std::clamp(uv.y, 0.f, 1.f) * (sd.height - 1);
 
         int x0 = (int)std::floor(u);
         int y0 = (int)std::floor(v);
-        int x1 = std::clamp(x0 + 1, 0, sm_width - 1);
-        int y1 = std::clamp(y0 + 1, 0, sm_height - 1);
+        int x1 = std::min(x0 + 1, sd.width - 1);
+        int y1 = std::min(y0 + 1, sd.height - 1);
 
         float s = u - x0;
         float t = v - y0;
 
-        float d00 = buffer[x0 + y0 * sm_width];
-        float d10 = buffer[x1 + y0 * sm_width];
-        float d01 = buffer[x0 + y1 * sm_width];
-        float d11 = buffer[x1 + y1 * sm_width];
+        T d00 = fetch(x0 + y0 * sd.width);
+        T d10 = fetch(x1 + y0 * sd.width);
+        T d01 = fetch(x0 + y1 * sd.width);
+        T d11 = fetch(x1 + y1 * sd.width);
 
-        float lerp_top = d00 + s * (d10 - d00);
-        float lerp_bottom = d01 + s * (d11 - d01);
+        T lerp_top = d00 + s * (d10 - d00);
+        T lerp_bottom = d01 + s * (d11 - d01);
         
         return lerp_top + t * (lerp_bottom - lerp_top);
     }
+
+    static vec2 min_max(float a, float b) { return a < b ? vec2(a, b) : vec2(b, a); }
+    static vec2 min_max(const vec2& a, const vec2& b) { return vec2(std::min(a.x, b.x), std::max(a.y, b.y)); }
+    // 按片段的视空间深度选择级联
+    static const ShadowMapData& select_shadow_map(int light_idx, const vec3& world_pos, const ShaderContext* context);
+
+    // 由深度图逐层 2x2 归约出 min/max 金字塔
+    static void build_depth_mips(ShadowMapData& sd);
+    // 返回以 uv 为中心、半径为 radius 的方形区域内 (含双线性采样会触及的 texel) 深度范围的保守估计
+    // 只读取金字塔中不超过 2x2 个 texel
+    template<DepthFormat F>
+    static vec2 depth_range(const ShadowMapData& sd, vec2 uv, float radius);
 public:
     virtual ~IShadowStrategy() = default;
 
+    // 深度图 (重新) 渲染之后调用一次，预滤波类的策略在这里生成 moments
+    virtual void prefilter(ShadowMapData& sd) {}
     // 返回值 0.0~1.0，表示光照强度系数
     virtual float calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) = 0;
 };
 
 /* 定义HardShadowStrategy类，用于硬阴影计算 */
 class HardShadowStrategy : public IShadowStrategy {
+private:
+    template<DepthFormat F> float shadow(const ShadowMapData& sd, vec2 uv, float z_screen);
 public:
     float calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) override;
 };
 
-// 高级阴影：PCSS (为后续实现预留)
+// 高级阴影：PCSS
+// 深度图渲染后生成 min/max 金字塔，搜索区域完全受光或完全处于阴影时用粗层级的查询提前返回，
+// 只有真正存在半影的区域才做 Poisson 采样
 class PCSSShadowStrategy : public IShadowStrategy {
+private:
+    static constexpr float SEARCH_RADIUS = 0.01f; // Blocker Search 半径
+    static constexpr float LIGHT_SIZE = 0.025f;   // 光源尺寸
+    static constexpr float MIN_PENUMBRA = 0.0005f;
+    static constexpr float MAX_PENUMBRA = 0.02f;  // 半影半径上限，同时也是过滤区域的最大半径
+
+    template<DepthFormat F> float shadow(const ShadowMapData& sd, vec2 uv, float z_screen);
 public:
+    void prefilter(ShadowMapData& sd) override { build_depth_mips(sd); }
+    float calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) override;
+};
+
+/* 定义VSMShadowStrategy类：方差阴影贴图
+ * 线性深度的一阶、二阶矩在深度图渲染后用可分离的盒式模糊预滤波一次，着色时只需一次双线性采样，
+ * 再由 Chebyshev 不等式估计可见度 */
+class VSMShadowStrategy : public IShadowStrategy {
+private:
+    static constexpr float MIN_VARIANCE = 1e-7f;  // 方差下限，抑制平面上的自阴影
+    static constexpr float LIGHT_BLEEDING = 0.3f; // 低于该值的可见度视为完全遮挡，减轻漏光
+    int blur_radius;
+
+    // Reverse-Z 的屏幕深度换算回光源视空间的线性深度，并以贴图的远平面归一化
+    static float linear_depth(const ShadowMapData& sd, float z_screen);
+public:
+    explicit VSMShadowStrategy(int blur_radius) : blur_radius(blur_radius) {}
+
+    void prefilter(ShadowMapData& sd) override;
     float calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) override;
 };
\ No newline at end of file
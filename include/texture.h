@@ -1,48 +1,181 @@
 #pragma once
 #include <map>
+#include <future>
 #include "tgaimage.h"
 #include "geometry.h"
+#include "block_compression.h"
 
 namespace Tex {
-    enum class Interpolation { NEAREST, BILINEAR };
+    // TRILINEAR 与 ANISOTROPIC 依据 uv 的屏幕空间导数在 mip 链上选择层级，其余只采样原图
+    enum class Interpolation { NEAREST, BILINEAR, TRILINEAR, ANISOTROPIC };
     enum class WrapMode { REPEAT, CLAMP, MIRROR };
+    // texel 的存储方式：未压缩 RGBA8 的三种排布 (逐行、4x4 分块且每块恰好一条缓存行、Morton Z 序)，
+    // 或 4x4 块按行排列的 BC1/BC3/BC5 压缩格式
+    enum class Layout { LINEAR, TILED, MORTON, BC1, BC3, BC5 };
+    // 纹理的用途，决定压缩时选用的格式
+    enum class Usage { COLOR, DATA, TANGENT_NORMAL };
 }
 using Interpolation = Tex::Interpolation;
 using WrapMode = Tex::WrapMode;
+using TexelLayout = Tex::Layout;
+using TextureUsage = Tex::Usage;
+
+constexpr bool is_block_compressed(TexelLayout l) { return l == TexelLayout::BC1 || l == TexelLayout::BC3 || l == TexelLayout::BC5; }
+
+/* 纹理的加载与采样设置，由 TextureManager 按场景配置统一指定 */
+struct TextureOptions {
+    Interpolation filter = Interpolation::BILINEAR;
+    WrapMode wrap = WrapMode::REPEAT;
+    int max_anisotropy = 1;
+    TexelLayout layout = TexelLayout::LINEAR; // 不压缩时的 texel 排布
+    bool compress = false; // 按用途选择 BC1/BC3/BC5 块压缩，压缩结果缓存在 TEXTURE_CACHE_DIR 中
+};
+
+inline const std::string TEXTURE_CACHE_DIR = "texture_cache";
+
+/* 一条 64 字节的缓存行，texel 存储以它为单位分配，保证 4x4 分块与缓存行对齐 (压缩格式下存放压缩块) */
+struct alignas(64) TexelLine {
+    uint32_t texels[16];
+};
+
+/* 预解码的纹理层：固定 4 通道 RGBA8，每个 texel 一个 uint32 (R | G << 8 | B << 16 | A << 24)
+ * 加载时一次性转换，采样时不再有按通道数的分支与拷贝
+ * 各排布下 texel 的下标都可以拆成只依赖 x 的列偏移与只依赖 y 的行偏移之和，
+ * 双线性采样的 2x2 足迹只需计算两个列偏移与两个行偏移 */
+struct TexelLevel {
+    static constexpr int TILE_BITS = 2; // TILED: 4x4 texel 一块
+
+    int width = 0, height = 0;
+    TexelLayout layout = TexelLayout::LINEAR;
+    int tiles_x = 0;     // TILED 与压缩格式: 每行的分块数
+    int morton_bits = 0; // MORTON: 交错的低位数，即较短边补齐到 2 的幂后的 log2，较长边多出的高位直接拼接在后面
+    std::vector<TexelLine> lines;
+
+    const uint32_t* texels() const { return reinterpret_cast<const uint32_t*>(lines.data()); }
+    uint32_t* texels() { return reinterpret_cast<uint32_t*>(lines.data()); }
+    const uint8_t* bytes() const { return reinterpret_cast<const uint8_t*>(lines.data()); }
+    uint8_t* bytes() { return reinterpret_cast<uint8_t*>(lines.data()); }
+    size_t size_in_bytes() const { return lines.size() * sizeof(TexelLine); }
+
+    static constexpr int block_bytes(TexelLayout l) {
+        return l == TexelLayout::BC1 ? BC::BC1_BLOCK_BYTES : l == TexelLayout::BC3 ? BC::BC3_BLOCK_BYTES : BC::BC5_BLOCK_BYTES;
+    }
+    // 压缩格式下 (x, y) 所在的块
+    template<TexelLayout L> const uint8_t* block(int x, int y) const {
+        return bytes() + ((size_t)(y >> TILE_BITS) * tiles_x + (x >> TILE_BITS)) * block_bytes(L);
+    }
+
+    template<TexelLayout L> size_t column(int x) const {
+        if constexpr (L == TexelLayout::LINEAR) return x;
+        else if constexpr (L == TexelLayout::TILED) return ((size_t)(x >> TILE_BITS) << (2 * TILE_BITS)) + (x & ((1 << TILE_BITS) - 1));
+        else return spread_bits(x & ((1 << morton_bits) - 1)) | (size_t)(x >> morton_bits) << (2 * morton_bits);
+    }
+    template<TexelLayout L> size_t row(int y) const {
+        if constexpr (L == TexelLayout::LINEAR) return (size_t)y * width;
+        else if constexpr (L == TexelLayout::TILED) return ((size_t)(y >> TILE_BITS) * tiles_x << (2 * TILE_BITS)) + ((y & ((1 << TILE_BITS) - 1)) << TILE_BITS);
+        else return spread_bits(y & ((1 << morton_bits) - 1)) << 1 | (size_t)(y >> morton_bits) << (2 * morton_bits);
+    }
+    template<TexelLayout L> uint32_t fetch(int x, int y) const {
+        if constexpr (is_block_compressed(L)) {
+            int i = (y & 3) * 4 + (x & 3);
+            if constexpr (L == TexelLayout::BC1) return BC::decode_bc1(block<L>(x, y), i);
+            else if constexpr (L == TexelLayout::BC3) return BC::decode_bc3(block<L>(x, y), i);
+            else return BC::decode_bc5(block<L>(x, y), i);
+        } else {
+            return texels()[column<L>(x) + row<L>(y)];
+        }
+    }
+    template<TexelLayout L> void store(int x, int y, uint32_t t) { texels()[column<L>(x) + row<L>(y)] = t; }
+
+    void allocate(int w, int h, TexelLayout l); // 按排布分配，分块与 Morton 排布会补齐边长
+
+private:
+    // 把 16 位整数的各位分散到偶数位上
+    static uint32_t spread_bits(uint32_t v) {
+        v = (v | v << 8) & 0x00FF00FFu;
+        v = (v | v << 4) & 0x0F0F0F0Fu;
+        v = (v | v << 2) & 0x33333333u;
+        v = (v | v << 1) & 0x55555555u;
+        return v;
+    }
+};
+
+struct Texture;
+// 按过滤方式、环绕方式与 texel 排布在编译期特化的采样函数，返回 [0, 1] 范围的 RGBA
+using TextureSampler = vec4 (*)(const Texture& tex, vec2 uv, vec2 duv_dx, vec2 duv_dy);
 
 struct Texture {
-    TGAImage* data;           // 原始图片数据
-    Interpolation mode;       // NEAREST, BILINEAR
+    std::vector<TexelLevel> mips; // mip 链，第 0 层为原图，边长逐层减半直到 1x1 (不使用 mip 时只有第 0 层)
+    Interpolation mode;       // NEAREST, BILINEAR, TRILINEAR, ANISOTROPIC
     WrapMode wrap;            // REPEAT, CLAMP, MIRROR
+    int max_anisotropy;       // ANISOTROPIC 沿主轴方向的最大采样数
+    bool alpha = false;       // 原图是否带 Alpha 通道
+    TexelLayout layout;       // LINEAR, TILED, MORTON, BC1, BC3, BC5
+    TextureSampler sampler;   // 构造时按 mode、wrap 与 layout 选定
 
-    Texture(const std::string filename, Interpolation m = Interpolation::BILINEAR, WrapMode w = WrapMode::REPEAT) 
-        : data(new TGAImage(filename.c_str())), mode(m), wrap(w) {
-            data->flip_vertically();
-        }
+    Texture(const std::string filename, const TextureOptions& options = {}, TextureUsage usage = TextureUsage::COLOR);
+
+    // 只采样原图，等价于导数为零时的 sample_grad
+    vec4 sample_uv(vec2 uv) const { return sampler(*this, uv, vec2(0, 0), vec2(0, 0)); }
+    // 以 uv 在屏幕 x/y 方向上的导数确定采样足迹 (同 GLSL 的 textureGrad)
+    vec4 sample_grad(vec2 uv, vec2 duv_dx, vec2 duv_dy) const { return sampler(*this, uv, duv_dx, duv_dy); }
+    bool has_alpha() const { return alpha; }
+
+    int levels() const { return (int)mips.size(); }
+    const TexelLevel& level(int i) const { return mips[i]; }
+    size_t size_in_bytes() const;
 
-    float handle_wrap(float v) const; 
-    TGAColor sample_uv(vec2 uv) const;
+private:
+    void generate_mips();
+    void compress(TexelLayout format);
+    bool read_cache(const std::string& path, const std::string& source);
+    void write_cache(const std::string& path, const std::string& source) const;
+    static TextureSampler select_sampler(Interpolation m, WrapMode w, TexelLayout l);
 };
 
+/* 纹理在后台线程中解码，load_texture 立即返回 id；使用前须调用 wait_all 等待全部加载完成 */
 class TextureManager {
 private:
     int next_id = 0; // 将要分配的纹理id，从0开始递增
-    std::unordered_map<std::string, int> texture_map; // path -> id
+    TextureOptions options = {Interpolation::TRILINEAR}; // 之后加载的纹理使用的设置
+    std::unordered_map<std::string, int> texture_map; // path -> id，同一路径只发起一次加载
+    std::vector<std::string> texture_paths; // id -> path
+    std::vector<std::future<std::unique_ptr<Texture>>> pending; // id -> 加载任务，完成后移入 texture_pool
     std::vector<std::unique_ptr<Texture>> texture_pool;
 public:
-    int load_texture(const std::string& path) {
+    int load_texture(const std::string& path, TextureUsage usage = TextureUsage::COLOR) {
         if(path.empty()) return -1; // 空路径无法加载
         if (texture_map.count(path)) return texture_map[path]; // 已加载过，直接返回id
 
         texture_map[path] = next_id;
-        texture_pool.push_back(std::make_unique<Texture>(path));
-
-        std::cout << "Texture loaded: " << path << " (ID: " << next_id << ")" << std::endl;
+        texture_paths.push_back(path);
+        pending.push_back(std::async(std::launch::async, [path, usage, opt = options] {
+            return std::make_unique<Texture>(path, opt, usage);
+        }));
+        texture_pool.emplace_back();
         return next_id++;
     }
+
+    // 等待所有已发起的加载完成，按 id 顺序输出加载结果
+    void wait_all() {
+        for(int id = 0; id < next_id; id++) {
+            if(!pending[id].valid()) continue;
+            texture_pool[id] = pending[id].get();
+            std::cout << "Texture loaded: " << texture_paths[id] << " (ID: " << id << ", " << texture_pool[id]->size_in_bytes() / 1024 << " KB)" << std::endl;
+        }
+    }
         
+    void set_filter(Interpolation mode, int aniso = 1) {
+        options.filter = mode;
+        options.max_anisotropy = std::max(1, aniso);
+    }
+
+    void set_layout(TexelLayout l) { options.layout = l; }
+    void set_compression(bool enable) { options.compress = enable; }
+
     Texture* get_texture(int id) const {
         assert(id >= 0 && id < texture_pool.size());
+        assert(texture_pool[id] && "texture is still loading, call wait_all first");
         return texture_pool[id].get();
     }
 };
@@ -71,7 +204,9 @@ struct Material {
         USE_SPECULAR_MAP = 1 << 2,
         USE_NM_TANGENT_MAP = 1 << 3
     };
+    static constexpr int FEATURE_COMBINATIONS = 1 << 4; // 特性位的全部组合数，用于生成着色器特化版本
     int features = 0; // 默认不开启任何纹理
+    bool alpha_blend = false; // 需要 Alpha 混合的材质不能进入延迟渲染路径
 
     bool has_feature(Feature f) const { return features & f; }
 };
@@ -32,8 +32,8 @@ struct TGAImage {
     enum Format { GRAYSCALE=1, RGB=3, RGBA=4 };
     TGAImage() = default;
     TGAImage(const int w, const int h, const int bpp, TGAColor c = {});
-    TGAImage(const std::string filename) { read_tga_file(filename); } // additional
-    bool  read_tga_file(const std::string filename);
+    TGAImage(const std::string filename, const bool vflip=false) { read_tga_file(filename, vflip); } // additional
+    bool  read_tga_file(const std::string filename, const bool vflip=false); // vflip: 行序自底向上，与 write_tga_file 一致
     bool write_tga_file(const std::string filename, const bool vflip=true, const bool rle=true) const;
     void flip_horizontally();
     void flip_vertically();
@@ -41,9 +41,11 @@ struct TGAImage {
     void set(const int x, const int y, const TGAColor &c);
     int width()  const;
     int height() const;
+    int bytespp() const { return bpp; } // additional
     std::uint8_t* buffer() { return data.data(); } // additional
+    const std::uint8_t* buffer() const { return data.data(); } // additional
 private:
-    bool   load_rle_data(std::ifstream &in);
+    bool   load_rle_data(const std::uint8_t *in, const std::uint8_t *end, const bool reverse);
     bool unload_rle_data(std::ofstream &out) const;
     int w = 0, h = 0;
     std::uint8_t bpp = 0;
@@ -0,0 +1,157 @@
+#include "block_compression.h"
+#include <limits>
+
+namespace BC {
+
+/* ======== BC1 颜色块 ======== */
+static uint32_t pack565(const float c[3]) {
+    auto q = [](float v, int max) { return (uint32_t)std::clamp((int)(v / 255.f * max + 0.5f), 0, max); };
+    return q(c[0], 31) << 11 | q(c[1], 63) << 5 | q(c[2], 31);
+}
+
+// 4 色模式的调色板，与解码结果逐位一致
+static void color_palette(uint32_t c0, uint32_t c1, int palette[4][3]) {
+    uint32_t r0, g0, b0, r1, g1, b1;
+    expand565(c0, r0, g0, b0);
+    expand565(c1, r1, g1, b1);
+    int p[4][3] = {{(int)r0, (int)g0, (int)b0}, {(int)r1, (int)g1, (int)b1},
+                   {(int)(2 * r0 + r1) / 3, (int)(2 * g0 + g1) / 3, (int)(2 * b0 + b1) / 3},
+                   {(int)(r0 + 2 * r1) / 3, (int)(g0 + 2 * g1) / 3, (int)(b0 + 2 * b1) / 3}};
+    std::memcpy(palette, p, sizeof(p));
+}
+
+// 为每个 texel 选择最近的调色板颜色，返回平方误差之和
+static int choose_color_indices(const int px[16][3], uint32_t c0, uint32_t c1, uint32_t& indices) {
+    int palette[4][3];
+    color_palette(c0, c1, palette);
+    int total = 0;
+    indices = 0;
+    for(int i = 0; i < 16; i++) {
+        int best = 0, best_err = INT32_MAX;
+        for(int k = 0; k < 4; k++) {
+            int dr = px[i][0] - palette[k][0], dg = px[i][1] - palette[k][1], db = px[i][2] - palette[k][2];
+            int err = dr * dr + dg * dg + db * db;
+            if(err < best_err) best_err = err, best = k;
+        }
+        indices |= (uint32_t)best << (2 * i);
+        total += best_err;
+    }
+    return total;
+}
+
+// 固定索引时按最小二乘求解两个端点：texel ≈ w * e0 + (1 - w) * e1
+static bool refine_endpoints(const int px[16][3], uint32_t indices, float e0[3], float e1[3]) {
+    static const float weight[4] = {1.f, 0.f, 2.f / 3.f, 1.f / 3.f};
+    float aa = 0, bb = 0, ab = 0, ax[3] = {0, 0, 0}, bx[3] = {0, 0, 0};
+    for(int i = 0; i < 16; i++) {
+        float a = weight[indices >> (2 * i) & 3], b = 1.f - a;
+        aa += a * a, bb += b * b, ab += a * b;
+        for(int c = 0; c < 3; c++) ax[c] += a * px[i][c], bx[c] += b * px[i][c];
+    }
+    float det = aa * bb - ab * ab;
+    if(std::abs(det) < 1e-6f) return false;
+    for(int c = 0; c < 3; c++) {
+        e0[c] = std::clamp((ax[c] * bb - bx[c] * ab) / det, 0.f, 255.f);
+        e1[c] = std::clamp((bx[c] * aa - ax[c] * ab) / det, 0.f, 255.f);
+    }
+    return true;
+}
+
+static void encode_color(const uint32_t texels[16], uint8_t* block) {
+    int px[16][3];
+    float mean[3] = {0, 0, 0};
+    for(int i = 0; i < 16; i++) {
+        for(int c = 0; c < 3; c++) {
+            px[i][c] = texels[i] >> (8 * c) & 0xFF;
+            mean[c] += px[i][c] / 16.f;
+        }
+    }
+
+    // 主成分方向：协方差矩阵上的幂迭代
+    float cov[6] = {0, 0, 0, 0, 0, 0}; // rr rg rb gg gb bb
+    for(int i = 0; i < 16; i++) {
+        float d[3] = {px[i][0] - mean[0], px[i][1] - mean[1], px[i][2] - mean[2]};
+        cov[0] += d[0] * d[0], cov[1] += d[0] * d[1], cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1], cov[4] += d[1] * d[2], cov[5] += d[2] * d[2];
+    }
+    float axis[3] = {1.f, 1.f, 1.f};
+    for(int iter = 0; iter < 8; iter++) {
+        float v[3] = {cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+                      cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+                      cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2]};
+        float len = std::max({std::abs(v[0]), std::abs(v[1]), std::abs(v[2])});
+        if(len < 1e-6f) break;
+        for(int c = 0; c < 3; c++) axis[c] = v[c] / len;
+    }
+
+    // 沿主轴投影最远的两个 texel 作为初始端点
+    int lo = 0, hi = 0;
+    float lo_t = std::numeric_limits<float>::max(), hi_t = -std::numeric_limits<float>::max();
+    for(int i = 0; i < 16; i++) {
+        float t = px[i][0] * axis[0] + px[i][1] * axis[1] + px[i][2] * axis[2];
+        if(t < lo_t) lo_t = t, lo = i;
+        if(t > hi_t) hi_t = t, hi = i;
+    }
+    float e0[3] = {(float)px[hi][0], (float)px[hi][1], (float)px[hi][2]};
+    float e1[3] = {(float)px[lo][0], (float)px[lo][1], (float)px[lo][2]};
+    uint32_t c0 = pack565(e0), c1 = pack565(e1), indices;
+    int err = choose_color_indices(px, c0, c1, indices);
+
+    // 一次最小二乘细化，误差更小时采用
+    if(refine_endpoints(px, indices, e0, e1)) {
+        uint32_t r0 = pack565(e0), r1 = pack565(e1), refined;
+        int refined_err = choose_color_indices(px, r0, r1, refined);
+        if(refined_err < err) c0 = r0, c1 = r1, indices = refined;
+    }
+
+    // BC1 只在 c0 > c1 时使用 4 色模式：交换端点并翻转索引 (0 <-> 1, 2 <-> 3)；端点相同时全部取索引 0
+    if(c0 < c1) {
+        std::swap(c0, c1);
+        indices ^= 0x55555555u;
+    } else if(c0 == c1) {
+        indices = 0;
+    }
+    uint64_t bits = c0 | c1 << 16 | (uint64_t)indices << 32;
+    std::memcpy(block, &bits, sizeof(bits));
+}
+
+/* ======== BC4 单通道块 ======== */
+static void encode_channel(const uint8_t values[16], uint8_t* block) {
+    uint32_t a0 = *std::max_element(values, values + 16), a1 = *std::min_element(values, values + 16);
+    uint64_t bits = a0 | a1 << 8;
+    if(a0 > a1) {
+        // 8 值模式：索引 0/1 为两个端点，2..7 由 a0 向 a1 线性过渡
+        uint32_t palette[8] = {a0, a1};
+        for(int k = 2; k < 8; k++) palette[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+        for(int i = 0; i < 16; i++) {
+            int best = 0, best_err = INT32_MAX;
+            for(int k = 0; k < 8; k++) {
+                int err = std::abs((int)values[i] - (int)palette[k]);
+                if(err < best_err) best_err = err, best = k;
+            }
+            bits |= (uint64_t)best << (16 + 3 * i);
+        }
+    }
+    std::memcpy(block, &bits, sizeof(bits));
+}
+
+/* ======== 各格式的块 ======== */
+void encode_bc1(const uint32_t texels[16], uint8_t* block) {
+    encode_color(texels, block);
+}
+
+void encode_bc3(const uint32_t texels[16], uint8_t* block) {
+    uint8_t alpha[16];
+    for(int i = 0; i < 16; i++) alpha[i] = texels[i] >> 24;
+    encode_channel(alpha, block);
+    encode_color(texels, block + 8);
+}
+
+void encode_bc5(const uint32_t texels[16], uint8_t* block) {
+    uint8_t r[16], g[16];
+    for(int i = 0; i < 16; i++) r[i] = texels[i] & 0xFF, g[i] = texels[i] >> 8 & 0xFF;
+    encode_channel(r, block);
+    encode_channel(g, block + 8);
+}
+
+}
@@ -33,8 +33,8 @@ int main(int argc, char** argv) {
     shaderManager->register_shader("phong", std::make_unique<PhongShader>());
     shaderManager->register_shader("gouraud", std::make_unique<GouraudShader>());
     shaderManager->register_shader("normal", std::make_unique<NormalShader>());
-    shaderManager->register_shader("standard", std::make_unique<StandardShader>());
-    shaderManager->register_shader("eye", std::make_unique<EyeShader>());
+    shaderManager->register_variants<StandardShader>("standard");
+    shaderManager->register_variants<EyeShader>("eye");
     shaderManager->register_shader("depth_only", std::make_unique<DepthShader>());
     
     // Initialize other Managers
@@ -46,6 +46,7 @@ int main(int argc, char** argv) {
     // Initialize Scene and Rasterizer
     Scene scene;
     Rasterizer r(width, height);
+    std::cout << "--- Raster Kernel: " << get_raster_kernel_name() << " ---" << std::endl;
 
     std::cout << "--- Initializing Scene: " << scene_name << " ---" << std::endl;
     Loader loader(config_path, scene_name);
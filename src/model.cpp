@@ -2,6 +2,7 @@
 #include <sstream>
 #include <filesystem>
 #include <iostream>
+#include <map>
 #include "model.h"
 
 namespace fs = std::filesystem;
@@ -49,6 +50,21 @@ static void calculate_mesh_tangents(Mesh& mesh) {
     }
 }
 
+static void build_unique_vertices(Mesh& mesh) {
+    std::map<VertexIndex, int> lookup;
+    mesh.vertex_indices.clear();
+    mesh.facet_vertex.resize(mesh.facet_vrt.size());
+
+    for (int i = 0; i < mesh.facet_vrt.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            VertexIndex idx = {mesh.facet_vrt[i][j], mesh.facet_uv[i][j], mesh.facet_nrm[i][j]};
+            auto [it, inserted] = lookup.emplace(idx, (int)mesh.vertex_indices.size());
+            if (inserted) mesh.vertex_indices.push_back(idx);
+            mesh.facet_vertex[i][j] = it->second;
+        }
+    }
+}
+
 Mesh& ModelManager::load_obj_to_model(int model_id, const std::string &full_path) {
     std::ifstream in(full_path);
     if (in.fail()) {
@@ -91,6 +107,7 @@ Mesh& ModelManager::load_obj_to_model(int model_id, const std::string &full_path
         }
     }
     calculate_mesh_tangents(mesh);
+    build_unique_vertices(mesh);
     model->add_mesh(std::move(mesh));
     return model->meshes.back();
 }
@@ -0,0 +1,186 @@
+#include "raster_kernel.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RASTER_KERNEL_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RASTER_KERNEL_X86 0
+#endif
+
+// GCC/Clang 需要以函数为单位开启 AVX2，这样整个程序仍可以只用基础指令集编译
+#if RASTER_KERNEL_X86 && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+/* ======== 覆盖测试：定点数边函数逐 lane 步进 ======== */
+static int coverage_scalar(const TriangleSetup& s, int px, int py, int lane_mask) {
+    for(const FixedEdge& e : s.coverage) {
+        int64_t value = e.evaluate(px, py), step = e.a * SUBPIXEL_ONE;
+        for(int i = 0; i < SIMD_LANES; i++, value += step) {
+            if(value < 0) lane_mask &= ~(1 << i);
+        }
+    }
+    return lane_mask;
+}
+
+/* ======== 标量实现 ======== */
+[[maybe_unused]] static int raster_kernel_scalar(const TriangleSetup& s, int px, int py, const float* depth, int stride, int lane_mask, DepthFunc func, LanePacket& out) {
+    // 判定采样点是否在三角形内部
+    lane_mask = coverage_scalar(s, px, py, lane_mask);
+    if(!lane_mask) return 0;
+
+    const float x = px * (1.f / SUBPIXEL_ONE), y = py * (1.f / SUBPIXEL_ONE);
+    float alpha0 = s.edges[0].evaluate(x, y), beta0 = s.edges[1].evaluate(x, y), gamma0 = s.edges[2].evaluate(x, y);
+    float z0 = s.z.evaluate(x, y), inv_w0 = s.inv_w.evaluate(x, y);
+
+    int mask = 0;
+    for(int i = 0; i < SIMD_LANES; i++) {
+        if(!(lane_mask >> i & 1)) continue;
+
+        float alpha = alpha0 + s.edges[0].a * i;
+        float beta = beta0 + s.edges[1].a * i;
+        float gamma = gamma0 + s.edges[2].a * i;
+
+        float z = z0 + s.z.a * i;
+        if(func == DepthFunc::Greater ? z <= depth[i * stride] : z < depth[i * stride]) continue; // 深度测试
+
+        // Perspective-Correct Interpolation
+        float w = 1.f / (inv_w0 + s.inv_w.a * i);
+        out.alpha[i] = alpha * w * s.inv_w1;
+        out.beta[i] = beta * w * s.inv_w2;
+        out.gamma[i] = gamma * w * s.inv_w3;
+        out.z[i] = z;
+        mask |= 1 << i;
+    }
+    return mask;
+}
+
+#if RASTER_KERNEL_X86
+/* ======== SSE 实现：两组 4-wide ======== */
+static int raster_kernel_sse(const TriangleSetup& s, int px, int py, const float* depth, int stride, int lane_mask, DepthFunc func, LanePacket& out) {
+    // SSE2 没有 64 位整数比较，覆盖测试按标量进行
+    lane_mask = coverage_scalar(s, px, py, lane_mask);
+    if(!lane_mask) return 0;
+
+    const float x = px * (1.f / SUBPIXEL_ONE), y = py * (1.f / SUBPIXEL_ONE);
+    const __m128 one = _mm_set1_ps(1.f);
+    auto eval = [&](const EdgeFunction& e, __m128 lane) {
+        return _mm_add_ps(_mm_set1_ps(e.evaluate(x, y)), _mm_mul_ps(_mm_set1_ps(e.a), lane));
+    };
+
+    int mask = 0;
+    for(int half = 0; half < SIMD_LANES; half += 4) {
+        int half_mask = (lane_mask >> half) & 0xF;
+        if(!half_mask) continue;
+
+        // SSE 没有 gather，只读取被覆盖 lane 的深度
+        alignas(16) float d[4] = {0, 0, 0, 0};
+        for(int i = 0; i < 4; i++) if(half_mask >> i & 1) d[i] = depth[(half + i) * stride];
+
+        const __m128 lane = _mm_setr_ps(half, half + 1, half + 2, half + 3);
+        __m128 z = eval(s.z, lane);
+        __m128 dv = _mm_load_ps(d);
+        int m = half_mask & _mm_movemask_ps(func == DepthFunc::Greater ? _mm_cmpnle_ps(z, dv) : _mm_cmpnlt_ps(z, dv));
+        if(!m) continue;
+
+        __m128 alpha = eval(s.edges[0], lane), beta = eval(s.edges[1], lane), gamma = eval(s.edges[2], lane);
+        __m128 w = _mm_div_ps(one, eval(s.inv_w, lane));
+        _mm_store_ps(out.alpha + half, _mm_mul_ps(_mm_mul_ps(alpha, w), _mm_set1_ps(s.inv_w1)));
+        _mm_store_ps(out.beta + half, _mm_mul_ps(_mm_mul_ps(beta, w), _mm_set1_ps(s.inv_w2)));
+        _mm_store_ps(out.gamma + half, _mm_mul_ps(_mm_mul_ps(gamma, w), _mm_set1_ps(s.inv_w3)));
+        _mm_store_ps(out.z + half, z);
+        mask |= m << half;
+    }
+    return mask;
+}
+
+/* ======== AVX2 实现：8-wide ======== */
+TARGET_AVX2 static inline __m256 eval_avx2(const EdgeFunction& e, float x, float y, __m256 lane) {
+    return _mm256_add_ps(_mm256_set1_ps(e.evaluate(x, y)), _mm256_mul_ps(_mm256_set1_ps(e.a), lane));
+}
+
+// 8 个 lane 的定点数边函数值分成两组 4 x int64，返回取负值的 lane
+TARGET_AVX2 static inline int outside_avx2(const FixedEdge& e, int px, int py) {
+    int64_t value = e.evaluate(px, py), step = e.a * SUBPIXEL_ONE;
+    __m256i lo = _mm256_add_epi64(_mm256_set1_epi64x(value), _mm256_setr_epi64x(0, step, 2 * step, 3 * step));
+    __m256i hi = _mm256_add_epi64(lo, _mm256_set1_epi64x(4 * step));
+    const __m256i zero = _mm256_setzero_si256();
+    int lo_mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(zero, lo)));
+    int hi_mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(zero, hi)));
+    return lo_mask | hi_mask << 4;
+}
+
+TARGET_AVX2 static int raster_kernel_avx2(const TriangleSetup& s, int px, int py, const float* depth, int stride, int lane_mask, DepthFunc func, LanePacket& out) {
+    // 覆盖测试：三条定点数边函数都不取负值
+    int mask = lane_mask & ~(outside_avx2(s.coverage[0], px, py) | outside_avx2(s.coverage[1], px, py) | outside_avx2(s.coverage[2], px, py));
+    if(!mask) return 0;
+
+    const float x = px * (1.f / SUBPIXEL_ONE), y = py * (1.f / SUBPIXEL_ONE);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // 深度测试：带掩码的 gather 只读取被覆盖 lane 的深度
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i covered = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+    __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    __m256 d = _mm256_mask_i32gather_ps(zero, depth, offsets, _mm256_castsi256_ps(covered), 4);
+
+    __m256 z = eval_avx2(s.z, x, y, lane);
+    mask &= _mm256_movemask_ps(func == DepthFunc::Greater ? _mm256_cmp_ps(z, d, _CMP_NLE_UQ) : _mm256_cmp_ps(z, d, _CMP_NLT_UQ));
+    if(!mask) return 0;
+
+    // Perspective-Correct Interpolation
+    __m256 alpha = eval_avx2(s.edges[0], x, y, lane);
+    __m256 beta = eval_avx2(s.edges[1], x, y, lane);
+    __m256 gamma = eval_avx2(s.edges[2], x, y, lane);
+    __m256 w = _mm256_div_ps(_mm256_set1_ps(1.f), eval_avx2(s.inv_w, x, y, lane));
+    _mm256_store_ps(out.alpha, _mm256_mul_ps(_mm256_mul_ps(alpha, w), _mm256_set1_ps(s.inv_w1)));
+    _mm256_store_ps(out.beta, _mm256_mul_ps(_mm256_mul_ps(beta, w), _mm256_set1_ps(s.inv_w2)));
+    _mm256_store_ps(out.gamma, _mm256_mul_ps(_mm256_mul_ps(gamma, w), _mm256_set1_ps(s.inv_w3)));
+    _mm256_store_ps(out.z, z);
+    return mask;
+}
+
+static bool cpu_supports_avx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+    if(!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false; // 操作系统需要保存 YMM 寄存器
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+struct KernelEntry {
+    RasterKernel kernel;
+    const char* name;
+};
+
+static KernelEntry select_raster_kernel() {
+#if RASTER_KERNEL_X86
+    if(cpu_supports_avx2()) return {raster_kernel_avx2, "AVX2"};
+    return {raster_kernel_sse, "SSE"};
+#else
+    return {raster_kernel_scalar, "Scalar"};
+#endif
+}
+
+static const KernelEntry& selected_kernel() {
+    static const KernelEntry entry = select_raster_kernel();
+    return entry;
+}
+
+RasterKernel get_raster_kernel() { return selected_kernel().kernel; }
+const char* get_raster_kernel_name() { return selected_kernel().name; }
@@ -1,5 +1,10 @@
 #include <algorithm>
 #include <any>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <omp.h>
 #include "rasterizer.h"
 
 /* ======== 静态辅助接口部分 ======== */
@@ -8,15 +13,47 @@ static T interpolate(float alpha, float beta, float gamma, const T& a, const T&
     return a * alpha + b * beta + c * gamma;
 }
 
+/* Resolve Pass: 以盒式滤波把每个像素的全部子采样合成为一个值，SSAA 与 MSAA 共用 */
 template<typename T>
-static T get_avg(int ind, int ssaa, const std::vector<T>& buffer_data) {
-    int sample_factor = ssaa * ssaa;
-    T sum{}; 
-    for(int i = 0; i < sample_factor; i++) {
-        sum = sum + buffer_data[ind * sample_factor + i];
+static std::vector<T> resolve_samples(const std::vector<T>& samples, int sample_factor, int pixels) {
+    std::vector<T> resolved(pixels);
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < pixels; i++) {
+        T sum{};
+        for(int k = 0; k < sample_factor; k++) {
+            sum = sum + samples[i * sample_factor + k];
+        }
+        resolved[i] = sum / (float)sample_factor;
+    }
+    return resolved;
+}
+
+/* 八面体编码：把单位向量压缩成两个 16 位有符号定点数 */
+static uint32_t pack_unit_vector(const vec3& n) {
+    auto sign = [](float f) { return f < 0.f ? -1.f : 1.f; };
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    float u = l1 > 0.f ? n.x / l1 : 0.f;
+    float v = l1 > 0.f ? n.y / l1 : 0.f;
+    if(n.z < 0.f) { // 下半球沿对角线折叠到外侧
+        float fu = (1.f - std::abs(v)) * sign(u);
+        float fv = (1.f - std::abs(u)) * sign(v);
+        u = fu, v = fv;
+    }
+    auto quantize = [](float f) { return (uint32_t)(uint16_t)(int16_t)std::lround(std::clamp(f, -1.f, 1.f) * 32767.f); };
+    return quantize(u) | quantize(v) << 16;
+}
+
+static vec3 unpack_unit_vector(uint32_t p) {
+    auto sign = [](float f) { return f < 0.f ? -1.f : 1.f; };
+    float u = (int16_t)(p & 0xffff) / 32767.f;
+    float v = (int16_t)(p >> 16) / 32767.f;
+    float z = 1.f - std::abs(u) - std::abs(v);
+    if(z < 0.f) {
+        float fu = (1.f - std::abs(v)) * sign(u);
+        float fv = (1.f - std::abs(u)) * sign(v);
+        u = fu, v = fv;
     }
-    T avg = sum / (float)sample_factor;
-    return avg;
+    return vec3(u, v, z).normalized();
 }
 
 static float signed_triangle_area(vec4 v1, vec4 v2, vec4 v3) {
@@ -41,6 +78,10 @@ static void assembly_triangle(std::array<Vertex, 3>& verts, Triangle& t) {
         v.y = (v.y + 1.f) * 0.5f * height;
         v.z = (1.f - v.z) * 0.5f;
 
+        // Snapping: 吸附到子像素网格，保护带内的坐标在 float 中可以精确表示
+        v.x = std::round(v.x * SUBPIXEL_ONE) / SUBPIXEL_ONE;
+        v.y = std::round(v.y * SUBPIXEL_ONE) / SUBPIXEL_ONE;
+
         // Batch Assembly Attributes
         t.set_vertex(i, v);
         t.set_color(i, verts[i].color);
@@ -51,6 +92,96 @@ static void assembly_triangle(std::array<Vertex, 3>& verts, Triangle& t) {
         t.set_bitangent(i, verts[i].bitangent);
     }
 }
+// Triangle Setup: 建立边函数，它们的值就是未经透视矫正的重心坐标；背面或退化三角形返回 false
+static bool setup_triangle(const Triangle& t, TriangleSetup& setup) {
+    vec4 v1 = t.v[0], v2 = t.v[1], v3 = t.v[2];
+
+    // 吸附后的顶点坐标是子像素的整数倍，覆盖测试完全在整数上进行
+    int64_t fx[3], fy[3];
+    for(int i = 0; i < 3; i++) {
+        fx[i] = (int64_t)(t.v[i].x * SUBPIXEL_ONE);
+        fy[i] = (int64_t)(t.v[i].y * SUBPIXEL_ONE);
+    }
+
+    // Back-Face Culling: 以定点数的有向面积精确判定，退化三角形一并剔除
+    int64_t area2 = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fy[1] - fy[0]) * (fx[2] - fx[0]);
+    if(area2 <= 0) return false;
+    setup.coverage[0] = FixedEdge(fx[1], fy[1], fx[2], fy[2]);
+    setup.coverage[1] = FixedEdge(fx[2], fy[2], fx[0], fy[0]);
+    setup.coverage[2] = FixedEdge(fx[0], fy[0], fx[1], fy[1]);
+    float total_area = (float)area2 / (2.f * SUBPIXEL_ONE * SUBPIXEL_ONE);
+
+    // 性能小trick: 化除法为乘法
+    float inv_total_area = 1.f / total_area; 
+    setup.edges[0] = EdgeFunction(v2, v3, inv_total_area);
+    setup.edges[1] = EdgeFunction(v3, v1, inv_total_area);
+    setup.edges[2] = EdgeFunction(v1, v2, inv_total_area);
+    setup.inv_w1 = 1.f / v1.w, setup.inv_w2 = 1.f / v2.w, setup.inv_w3 = 1.f / v3.w;
+
+    // 屏幕空间中 z 与 1 / w 同样是线性的，可以和边函数一起步进
+    setup.z = EdgeFunction::combine(setup.edges, v1.z, v2.z, v3.z);
+    setup.inv_w = EdgeFunction::combine(setup.edges, setup.inv_w1, setup.inv_w2, setup.inv_w3);
+    return true;
+}
+
+/* 裁剪空间中的平面，dot(plane, pos) >= 0 的一侧为内侧
+ * 0-3: 视锥的左右下上平面，只用于整体剔除；4: 近平面；5-8: 保护带 */
+constexpr float GUARD_X = 1.f + 2.f * GUARD_BAND / width;
+constexpr float GUARD_Y = 1.f + 2.f * GUARD_BAND / height;
+static const float clip_planes[9][4] = {
+    { 1, 0, 0, 1}, {-1, 0, 0, 1}, {0,  1, 0, 1}, {0, -1, 0, 1},
+    { 0, 0, 1, 1},
+    { 1, 0, 0, GUARD_X}, {-1, 0, 0, GUARD_X}, {0,  1, 0, GUARD_Y}, {0, -1, 0, GUARD_Y}
+};
+constexpr int CLIP_VIEW_MASK = 0x1f;  // 全部顶点在同一个平面外侧即可剔除 (视锥与近平面)
+constexpr int CLIP_SPLIT_MASK = 0x1f0; // 需要真正裁剪的平面 (近平面与保护带)
+
+static float clip_distance(const vec4& p, int plane) {
+    const float* c = clip_planes[plane];
+    return c[0] * p.x + c[1] * p.y + c[2] * p.z + c[3] * p.w;
+}
+
+// 顶点的裁剪码：第 i 位表示位于第 i 个平面的外侧
+static int clip_code(const vec4& p) {
+    int code = 0;
+    for(int i = 0; i < 9; i++) {
+        if(clip_distance(p, i) < 0.f) code |= 1 << i;
+    }
+    return code;
+}
+
+// 裁剪空间中属性都是线性的，交点处直接线性插值
+static Vertex lerp_vertex(const Vertex& a, const Vertex& b, float t) {
+    Vertex v;
+    v.pos = a.pos + (b.pos - a.pos) * t;
+    v.world_pos = a.world_pos + (b.world_pos - a.world_pos) * t;
+    v.color = a.color + (b.color - a.color) * t;
+    v.uv = a.uv + (b.uv - a.uv) * t;
+    v.tangent = a.tangent + (b.tangent - a.tangent) * t;
+    v.bitangent = a.bitangent + (b.bitangent - a.bitangent) * t;
+    v.normal = a.normal + (b.normal - a.normal) * t;
+    return v;
+}
+
+// Sutherland-Hodgman: 依次用 planes 中的平面裁剪多边形，返回剩余的顶点数
+static int clip_polygon(Vertex* poly, int count, int planes) {
+    Vertex buffer[2 * MAX_CLIP_VERTICES]; // 浮点误差下每条边最多产生两个顶点
+    for(int plane = 0; plane < 9 && count > 0; plane++) {
+        if(!(planes >> plane & 1)) continue;
+
+        int out = 0;
+        for(int i = 0; i < count; i++) {
+            const Vertex& a = poly[i];
+            const Vertex& b = poly[(i + 1) % count];
+            float da = clip_distance(a.pos, plane), db = clip_distance(b.pos, plane);
+            if(da >= 0.f) buffer[out++] = a;
+            if((da >= 0.f) != (db >= 0.f)) buffer[out++] = lerp_vertex(a, b, da / (da - db));
+        }
+        count = std::min(out, MAX_CLIP_VERTICES);
+        std::copy(buffer, buffer + count, poly);
+    }
+    return count;
+}
 /* ======== 静态辅助接口部分 ======== */
 
 /* ======== 正常 Pass 绘制接口部分 ======== */
@@ -90,17 +221,18 @@ void Rasterizer::draw_line(vec2 v1, vec2 v2, TGAColor color) {
     }
 }
 
-void Rasterizer::draw_triangle(const Triangle& triangle, const vec2& tri_min, const vec2& tri_max, const Tile& tile) {
-    vec4 v1 = triangle.v[0], v2 = triangle.v[1], v3 = triangle.v[2];
-    
-    // Back-Face Culling
-    float total_area = signed_triangle_area(v1, v2, v3);
-    if(total_area < 1e-5) return;
-    
-    // 性能小trick: 化除法为乘法
-    float inv_total_area = 1.f / total_area; 
-    float inv_w1 = 1.f / v1.w, inv_w2 = 1.f / v2.w, inv_w3 = 1.f / v3.w;
-    
+void Rasterizer::draw_triangle(const TriangleCache& tri, const Tile& tile, int draw_id, RasterPass pass, GBufferTile* gbuffer) {
+    IShader* shader = draw_commands[draw_id].shader;
+    const Triangle& triangle = tri.t;
+    const TriangleSetup& setup = tri.setup;
+    const vec2& tri_min = tri.min_xy;
+    const vec2& tri_max = tri.max_xy;
+
+    // Hi-Z: 深度平面在 Tile 内的最大值都不比 Tile 内最远的深度更近时，整个三角形在此 Tile 中被遮挡
+    // 注意用深度平面而不是顶点深度求上界：细长三角形边缘处的 z 会因舍入超出顶点深度的范围
+    int tile_index = tile.x_start / TILE_SIZE + tile.y_start / TILE_SIZE * tiles_x;
+    if(setup.z.max_in_block(tile.x_start, tile.y_start, TILE_SIZE) + HIZ_EPSILON <= hiz_tiles[tile_index]) return;
+
     // Scissor Test
     int min_x = std::max((int)tile.x_start, (int)std::floor(tri_min.x));
     int max_x = std::min((int)tile.x_start + TILE_SIZE - 1, (int)std::ceil(tri_max.x));
@@ -113,152 +245,758 @@ void Rasterizer::draw_triangle(const Triangle& triangle, const vec2& tri_min, co
     min_y = std::clamp(min_y, 0, height - 1);
     max_y = std::clamp(max_y, 0, height - 1);
 
-    for(int x = min_x; x <= max_x; x++) {
-        for(int y = min_y; y <= max_y; y++) {
-            for(int si = 0; si < ssaa; si++) {
-                for(int sj = 0; sj < ssaa; sj++) {
-                    float x_sample = x + si * 1.f / ssaa + 0.5f / ssaa;
-                    float y_sample = y + sj * 1.f / ssaa + 0.5f / ssaa;
-                    
-                    float alpha = signed_triangle_area(vec4(x_sample, y_sample, 0, 1), v2, v3) * inv_total_area;
-                    float beta = signed_triangle_area(vec4(x_sample, y_sample, 0, 1), v3, v1) * inv_total_area;
-                    float gamma = 1.f - alpha - beta;
-                    if (alpha < 0 || beta < 0 || gamma < 0) continue; // 判定采样点是否在三角形内部
-
-                    // Perspective-Correct Interpolation
-                    // 经过数学推导，深度的倒数符合线性插值关系：1 / w = 1 / w1 * alpha + 1 / w2 * beta + 1 / w3 * gamma
-                    // 同样可以推导出，矫正后的系数分别为：alpha_pc = alpha * (w / w1), beta_pc = beta * (w / w2), gamma_pc = gamma * (w / w3)
-                    float w = 1.f / (inv_w1 * alpha + inv_w2 * beta + inv_w3 * gamma);
-                    float alpha_pc = alpha * w * inv_w1;
-                    float beta_pc = beta * w * inv_w2;
-                    float gamma_pc = gamma * w * inv_w3;
-                    
-                    float z = interpolate(alpha, beta, gamma, v1.z, v2.z, v3.z);
-                    int ind = (x + y * width) * ssaa * ssaa + sj * ssaa + si;
-                    if(z <= get_depth(ind)) continue; // 深度测试
-                    
-                    // 顶点属性插值
-                    Vertex interpolated = Vertex::lerp(alpha_pc, beta_pc, gamma_pc, triangle);
-                    interpolated.pos = {x_sample, y_sample, z, 1.0f};
-                    
-                    // 调用片段着色器处理当前像素
-                    vec4 rgba;
-                    bool discard = currentShader->fragment(interpolated, rgba);
+    // 子采样点相对像素左下角的偏移，同样吸附到子像素网格上
+    const int sample_factor = ssaa * ssaa;
+    int sample_px[MAX_SAMPLES], sample_py[MAX_SAMPLES];
+    float sample_x[MAX_SAMPLES], sample_y[MAX_SAMPLES];
+    for(int k = 0; k < sample_factor; k++) {
+        sample_px[k] = (2 * (k % ssaa) + 1) * SUBPIXEL_ONE / (2 * ssaa);
+        sample_py[k] = (2 * (k / ssaa) + 1) * SUBPIXEL_ONE / (2 * ssaa);
+        sample_x[k] = (float)sample_px[k] / SUBPIXEL_ONE;
+        sample_y[k] = (float)sample_py[k] / SUBPIXEL_ONE;
+    }
+
+    // 深度预渲染之后，缓冲中已经是最近的深度：相等即可着色。着色后把深度抬高一个 ulp，
+    // 使深度完全相同的后续片段不再通过，与 Greater 测试下先提交者胜出的结果一致
+    const DepthFunc depth_func = pass == RasterPass::ColorEqual ? DepthFunc::GreaterEqual : DepthFunc::Greater;
+    auto resolved_depth = [&](float z) {
+        return pass == RasterPass::ColorEqual ? std::nextafter(z, std::numeric_limits<float>::infinity()) : z;
+    };
+
+    // MSAA 在离像素中心最近的被覆盖子采样处着色，使插值不会外推到三角形之外
+    int shading_order[MAX_SAMPLES];
+    if(msaa) {
+        auto center_dist = [&](int k) {
+            return (sample_x[k] - 0.5f) * (sample_x[k] - 0.5f) + (sample_y[k] - 0.5f) * (sample_y[k] - 0.5f);
+        };
+        std::iota(shading_order, shading_order + sample_factor, 0);
+        std::stable_sort(shading_order, shading_order + sample_factor, [&](int a, int b) { return center_dist(a) < center_dist(b); });
+    }
+
+    // 任一条边在整个块内都取负值时，整块都在三角形外部
+    auto block_outside = [&](int bx, int by, int size) {
+        for(const FixedEdge& e : setup.coverage) {
+            if(e.max_in_block((int64_t)bx * SUBPIXEL_ONE, (int64_t)by * SUBPIXEL_ONE, (int64_t)size * SUBPIXEL_ONE) < 0) return true;
+        }
+        return false;
+    };
+
+    // 片段包在整个三角形内复用，只需查询一次着色器所需的插值属性
+    static_assert(FRAGMENT_PACKET_SIZE == SIMD_LANES, "one kernel call fills at most one fragment packet");
+    const int varyings = shader->varyings();
+    FragmentPacket packet;
+    int packet_lane[SIMD_LANES];
+    float packet_x[SIMD_LANES], packet_y[SIMD_LANES]; // 片段的采样点坐标
+
+    // uv 的屏幕空间导数：U = u / w 与 W = 1 / w 在屏幕空间线性变化，u = U / W，
+    // 因此 du/dx = (U.a - u * W.a) / W (y 方向同理)，与 2x2 像素块内差分的结果一致而不需要辅助片段。
+    // SSAA 下每个子采样只代表 1/ssaa 个像素宽的足迹，导数按子采样间距缩放
+    EdgeFunction uv_planes[2];
+    if(varyings & VARYING_UV) {
+        for(int c = 0; c < 2; c++) {
+            uv_planes[c] = EdgeFunction::combine(setup.edges, triangle.tex_coord[0][c] * setup.inv_w1, triangle.tex_coord[1][c] * setup.inv_w2, triangle.tex_coord[2][c] * setup.inv_w3);
+        }
+    }
+    const float footprint = msaa ? 1.f : 1.f / ssaa;
+    auto interpolate_packet = [&]() {
+        packet.interpolate(triangle, varyings);
+        if(!(varyings & VARYING_UV)) return;
+        for(int j = 0; j < packet.count; j++) {
+            float inv_w = setup.inv_w.evaluate(packet_x[j], packet_y[j]);
+            float scale = footprint / inv_w;
+            for(int c = 0; c < 2; c++) {
+                packet.uv_dx[c][j] = (uv_planes[c].a - packet.uv[c][j] * setup.inv_w.a) * scale;
+                packet.uv_dy[c][j] = (uv_planes[c].b - packet.uv[c][j] * setup.inv_w.b) * scale;
+            }
+        }
+    };
+
+    // 延迟路径下片段不着色，插值结果连同图元序号写入 G-Buffer，留待光照 Pass 处理
+    int primitive = gbuffer ? gbuffer->primitive_count++ : -1;
+    auto write_gbuffer = [&](int j, int x, int y, int k) {
+        GBufferSample& s = gbuffer->samples[((x - tile.x_start) + (y - tile.y_start) * TILE_SIZE) * sample_factor + k];
+        if(varyings & VARYING_WORLD_POS) s.world_pos = packet.get_world_pos(j);
+        if(varyings & VARYING_UV) {
+            s.uv = packet.get_uv(j);
+            s.uv_dx = packet.get_uv_dx(j);
+            s.uv_dy = packet.get_uv_dy(j);
+        }
+        if(varyings & VARYING_NORMAL) s.normal = pack_unit_vector(packet.get_normal(j));
+        if(varyings & VARYING_TANGENT) s.tangent = pack_unit_vector(packet.get_tangent(j));
+        s.draw = draw_id;
+        s.primitive = primitive;
+    };
+
+    // Hierarchical Traversal: 先以 8x8 块、再以 4x4 子块为单位剔除完全位于三角形外部的区域
+    static_assert(BLOCK_SIZE == SIMD_LANES, "one block row maps to one SIMD register");
+    for(int by = tile.y_start; by <= max_y; by += BLOCK_SIZE) {
+        if(by + BLOCK_SIZE <= min_y) continue;
+        for(int bx = tile.x_start; bx <= max_x; bx += BLOCK_SIZE) {
+            if(bx + BLOCK_SIZE <= min_x) continue;
+            if(block_outside(bx, by, BLOCK_SIZE)) continue;
+
+            // Hi-Z: 同样的判定再以 8x8 块为单位进行一次
+            int block = bx / BLOCK_SIZE + by / BLOCK_SIZE * blocks_x;
+            if(setup.z.max_in_block(bx, by, BLOCK_SIZE) + HIZ_EPSILON <= hiz_block_depth(block)) continue;
+            bool depth_written = false;
 
-                    if (!discard) {
-                        set_depth(ind, z);
-                        set_pixel(ind, rgba);   
+            // 4x4 子块的剔除结果与包围盒裁剪一起折算成 lane 掩码
+            int row_mask[BLOCK_SIZE / SUB_BLOCK_SIZE] = {0};
+            for(int sy = 0; sy < BLOCK_SIZE / SUB_BLOCK_SIZE; sy++) {
+                for(int sx = 0; sx < BLOCK_SIZE / SUB_BLOCK_SIZE; sx++) {
+                    if(block_outside(bx + sx * SUB_BLOCK_SIZE, by + sy * SUB_BLOCK_SIZE, SUB_BLOCK_SIZE)) continue;
+                    row_mask[sy] |= ((1 << SUB_BLOCK_SIZE) - 1) << (sx * SUB_BLOCK_SIZE);
+                }
+            }
+            int column_mask = 0;
+            for(int i = 0; i < SIMD_LANES; i++) {
+                if(bx + i >= min_x && bx + i <= max_x) column_mask |= 1 << i;
+            }
+
+            for(int y = std::max(by, min_y); y <= std::min(by + BLOCK_SIZE - 1, max_y); y++) {
+                int lane_mask = column_mask & row_mask[(y - by) / SUB_BLOCK_SIZE];
+                if(!lane_mask) continue;
+
+                if(pass == RasterPass::DepthOnly) {
+                    // 深度预渲染：只做覆盖测试与深度测试并写入深度，MSAA 与 SSAA 相同
+                    for(int k = 0; k < sample_factor; k++) {
+                        LanePacket lanes;
+                        int base = (bx + y * width) * sample_factor + k;
+                        int mask = raster_kernel(setup, bx * SUBPIXEL_ONE + sample_px[k], y * SUBPIXEL_ONE + sample_py[k], &zbuffer[base], sample_factor, lane_mask, depth_func, lanes);
+                        for(; mask; mask &= mask - 1) {
+                            int i = std::countr_zero((unsigned)mask);
+                            set_depth(base + i * sample_factor, lanes.z[i]);
+                            depth_written = true;
+                        }
+                    }
+                    continue;
+                }
+
+                if(msaa) {
+                    // 覆盖测试与深度测试仍然逐子采样进行
+                    LanePacket sample_lanes[MAX_SAMPLES];
+                    int sample_mask[MAX_SAMPLES];
+                    int covered = 0;
+                    int row_base = (bx + y * width) * sample_factor;
+                    for(int k = 0; k < sample_factor; k++) {
+                        sample_mask[k] = raster_kernel(setup, bx * SUBPIXEL_ONE + sample_px[k], y * SUBPIXEL_ONE + sample_py[k], &zbuffer[row_base + k], sample_factor, lane_mask, depth_func, sample_lanes[k]);
+                        covered |= sample_mask[k];
+                    }
+                    if(!covered) continue;
+
+                    // 每个被覆盖的像素只进入片段包一次
+                    packet.count = 0;
+                    while(covered) {
+                        int i = std::countr_zero((unsigned)covered);
+                        covered &= covered - 1;
+
+                        int s = 0;
+                        while(!(sample_mask[shading_order[s]] >> i & 1)) s++;
+                        const LanePacket& lanes = sample_lanes[shading_order[s]];
+                        packet_lane[packet.count] = i;
+                        packet_x[packet.count] = bx + i + sample_x[shading_order[s]];
+                        packet_y[packet.count] = y + sample_y[shading_order[s]];
+                        packet.alpha[packet.count] = lanes.alpha[i];
+                        packet.beta[packet.count] = lanes.beta[i];
+                        packet.gamma[packet.count] = lanes.gamma[i];
+                        packet.count++;
+                    }
+
+                    interpolate_packet();
+                    packet.discard_mask = 0;
+                    if(!gbuffer) shader->fragment(packet);
+
+                    // 着色结果写入该像素所有通过测试的子采样
+                    for(int j = 0; j < packet.count; j++) {
+                        if(packet.discard_mask >> j & 1) continue;
+                        int i = packet_lane[j];
+                        int pixel = row_base + i * sample_factor;
+                        for(int k = 0; k < sample_factor; k++) {
+                            if(!(sample_mask[k] >> i & 1)) continue;
+                            set_depth(pixel + k, resolved_depth(sample_lanes[k].z[i]));
+                            depth_written = true;
+                            if(gbuffer) write_gbuffer(j, bx + i, y, k);
+                            else set_pixel(pixel + k, packet.rgba[j]);
+                        }
+                    }
+                    continue;
+                }
+
+                for(int k = 0; k < sample_factor; k++) {
+                    // 覆盖测试、深度测试与透视矫正一次处理 8 个像素
+                    LanePacket lanes;
+                    int base = (bx + y * width) * sample_factor + k;
+                    int mask = raster_kernel(setup, bx * SUBPIXEL_ONE + sample_px[k], y * SUBPIXEL_ONE + sample_py[k], &zbuffer[base], sample_factor, lane_mask, depth_func, lanes);
+                    if(!mask) continue;
+
+                    // 只有存活的 lane 才会进入片段着色阶段，紧凑地排进片段包
+                    packet.count = 0;
+                    while(mask) {
+                        int i = std::countr_zero((unsigned)mask);
+                        mask &= mask - 1;
+                        packet_lane[packet.count] = i;
+                        packet_x[packet.count] = bx + i + sample_x[k];
+                        packet_y[packet.count] = y + sample_y[k];
+                        packet.alpha[packet.count] = lanes.alpha[i];
+                        packet.beta[packet.count] = lanes.beta[i];
+                        packet.gamma[packet.count] = lanes.gamma[i];
+                        packet.count++;
+                    }
+
+                    // 只插值着色器声明的属性，整包调用一次片段着色器
+                    interpolate_packet();
+                    packet.discard_mask = 0;
+                    if(!gbuffer) shader->fragment(packet);
+
+                    for(int j = 0; j < packet.count; j++) {
+                        if(packet.discard_mask >> j & 1) continue;
+                        int i = packet_lane[j];
+                        int ind = base + i * sample_factor;
+                        set_depth(ind, resolved_depth(lanes.z[i]));
+                        depth_written = true;
+                        if(gbuffer) write_gbuffer(j, bx + i, y, k);
+                        else set_pixel(ind, packet.rgba[j]);
                     }
                 }
             }
+            if(depth_written) hiz_dirty[block] = 1;
         }
     }
 }
 
-void Rasterizer::draw_mesh(const Mesh& mesh) {
-    // 清理现有的 Tile 索引列表
-    for(auto& tile : tiles) {
-        tile.triangle_indices.clear(); 
+float Rasterizer::hiz_block_depth(int block) {
+    if(!hiz_dirty[block]) return hiz_blocks[block];
+    hiz_dirty[block] = 0;
+
+    // 块内全部子采样的最小深度，按 lane 分组累积以便编译器向量化
+    const int sample_factor = ssaa * ssaa;
+    int bx = (block % blocks_x) * BLOCK_SIZE, by = (block / blocks_x) * BLOCK_SIZE;
+    int row_samples = (std::min(bx + BLOCK_SIZE, width) - bx) * sample_factor;
+    float lane_min[SIMD_LANES];
+    std::fill(lane_min, lane_min + SIMD_LANES, std::numeric_limits<float>::max());
+    for(int y = by; y < std::min(by + BLOCK_SIZE, height); y++) {
+        const float* row = &zbuffer[(bx + y * width) * sample_factor];
+        int i = 0;
+        for(; i + SIMD_LANES <= row_samples; i += SIMD_LANES) {
+            for(int j = 0; j < SIMD_LANES; j++) lane_min[j] = row[i + j] < lane_min[j] ? row[i + j] : lane_min[j];
+        }
+        for(; i < row_samples; i++) lane_min[0] = std::min(lane_min[0], row[i]);
     }
+    float farthest = *std::min_element(lane_min, lane_min + SIMD_LANES);
+    hiz_blocks[block] = farthest;
 
-    // 缓存所有三角形的数据，避免重复计算
-    struct TriangleCache {
-        Triangle t;
-        vec2 min_xy, max_xy;
-    };
-    std::vector<TriangleCache> mesh_triangles(mesh.facet_vrt.size());
+    // Tile 的值取其所有块的最小值 (其中过期的块仍是下界)
+    int tx = bx / TILE_SIZE, ty = by / TILE_SIZE;
+    float tile_farthest = std::numeric_limits<float>::max();
+    for(int y = ty * TILE_SIZE / BLOCK_SIZE; y < std::min((ty + 1) * TILE_SIZE / BLOCK_SIZE, blocks_y); y++) {
+        for(int x = tx * TILE_SIZE / BLOCK_SIZE; x < std::min((tx + 1) * TILE_SIZE / BLOCK_SIZE, blocks_x); x++) {
+            tile_farthest = std::min(tile_farthest, hiz_blocks[x + y * blocks_x]);
+        }
+    }
+    hiz_tiles[tx + ty * tiles_x] = tile_farthest;
+    return farthest;
+}
+
+void Rasterizer::shade_vertices(int draw_id, int vertex_begin, int vertex_end) {
+    DrawCommand& cmd = draw_commands[draw_id];
+    const Mesh& mesh = *cmd.mesh;
+    Vertex* vertex_cache = &frame_vertices[cmd.first_vertex];
+    cmd.shader->bind_context(&cmd.context);
+
+    // 委托顶点着色器处理每个唯一顶点，获取处理后的顶点数据（Clip空间）
+    for(int i = vertex_begin; i < vertex_end; i++) {
+        vertex_cache[i] = cmd.shader->vertex(mesh, mesh.vertex_indices[i]);
+    }
+}
+
+void Rasterizer::draw_mesh(int draw_id, int face_begin, int face_end, BinSet& bins) {
+    DrawCommand& cmd = draw_commands[draw_id];
+    const Mesh& mesh = *cmd.mesh;
+    const Vertex* vertex_cache = &frame_vertices[cmd.first_vertex];
+    cmd.shader->bind_context(&cmd.context);
 
-    // 为并行计算预处理装箱
-    for(int i = 0; i < mesh.facet_vrt.size(); i++) {
+    // 图元装配：建立并装箱网格中 [face_begin, face_end) 范围内的三角形
+    for(int i = face_begin; i < face_end; i++) {
+        // 顶点已经在顶点着色阶段处理过（Clip空间），这里按索引取出
         std::array<Vertex, 3> verts;
-        
-        // 委托顶点着色器处理每个顶点，获取处理后的顶点数据（Clip空间）
-        verts[0] = currentShader->vertex(mesh, i, 0);
-        verts[1] = currentShader->vertex(mesh, i, 1);
-        verts[2] = currentShader->vertex(mesh, i, 2);
-        
-        // 将处理好的顶点装配成三角形
-        Triangle t;
-        assembly_triangle(verts, t);
+        for(int j = 0; j < 3; j++) verts[j] = vertex_cache[mesh.facet_vertex[i][j]];
+        cmd.shader->face(mesh, i, verts);
 
-        // 计算三角形的包围盒
-        auto [min, max] = find_bounding_box(t.v[0], t.v[1], t.v[2]);
+        // 视锥剔除：三个顶点都在同一个平面外侧
+        int codes[3] = {clip_code(verts[0].pos), clip_code(verts[1].pos), clip_code(verts[2].pos)};
+        if(codes[0] & codes[1] & codes[2] & CLIP_VIEW_MASK) continue;
 
-        // 将三角形缓存到 mesh_triangles 中
-        mesh_triangles[i].t = t;
-        mesh_triangles[i].min_xy = min, mesh_triangles[i].max_xy = max;
-        
-        // 计算影响了哪些 Tile
-        int t_min_x = std::clamp((int)std::floor(min.x / TILE_SIZE), 0, tiles_x - 1);
-        int t_max_x = std::clamp((int)std::ceil(max.x / TILE_SIZE), 0, tiles_x - 1);
-        int t_min_y = std::clamp((int)std::floor(min.y / TILE_SIZE), 0, tiles_y - 1);
-        int t_max_y = std::clamp((int)std::ceil(max.y / TILE_SIZE), 0, tiles_y - 1);
-
-        // Bin-Packing 策略
-        for(int ty = t_min_y; ty <= t_max_y; ty++) {
-            for(int tx = t_min_x; tx <= t_max_x; tx++) {
-                tiles[ty * tiles_x + tx].triangle_indices.push_back(i);
-            }
+        // 完全位于近平面前与保护带内的三角形 (绝大多数) 不需要裁剪
+        int split_planes = (codes[0] | codes[1] | codes[2]) & CLIP_SPLIT_MASK;
+        if(!split_planes) {
+            bin_triangle(draw_id, verts, bins);
+            continue;
+        }
+
+        // 裁剪成凸多边形后按扇形重新三角化，保持原有的环绕方向
+        Vertex poly[MAX_CLIP_VERTICES];
+        std::copy(verts.begin(), verts.end(), poly);
+        int count = clip_polygon(poly, 3, split_planes);
+        for(int j = 1; j + 1 < count; j++) {
+            std::array<Vertex, 3> fan = {poly[0], poly[j], poly[j + 1]};
+            bin_triangle(draw_id, fan, bins);
         }
     }
+}
 
-    // 按照 Tile 并行渲染
-    #pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < tiles.size(); i++) {
-        if (tiles[i].triangle_indices.empty()) continue;
-        
-        for (int tri_idx : tiles[i].triangle_indices) {
-            draw_triangle(mesh_triangles[tri_idx].t, mesh_triangles[tri_idx].min_xy, mesh_triangles[tri_idx].max_xy, tiles[i]);
+void Rasterizer::bin_triangle(int draw_id, std::array<Vertex, 3>& verts, BinSet& bins) {
+    // 将处理好的顶点装配成三角形
+    TriangleCache tri;
+    assembly_triangle(verts, tri.t);
+
+    // Back-Face Culling: 在装箱之前剔除，避免被分发到多个 Tile
+    if(!setup_triangle(tri.t, tri.setup)) return;
+
+    // 计算三角形的包围盒
+    auto [min, max] = find_bounding_box(tri.t.v[0], tri.t.v[1], tri.t.v[2]);
+    tri.min_xy = min, tri.max_xy = max;
+    tri.max_z = std::max({tri.t.v[0].z, tri.t.v[1].z, tri.t.v[2].z});
+
+    // 计算影响了哪些 Tile
+    int t_min_x = std::clamp((int)std::floor(min.x / TILE_SIZE), 0, tiles_x - 1);
+    int t_max_x = std::clamp((int)std::floor(max.x / TILE_SIZE), 0, tiles_x - 1);
+    int t_min_y = std::clamp((int)std::floor(min.y / TILE_SIZE), 0, tiles_y - 1);
+    int t_max_y = std::clamp((int)std::floor(max.y / TILE_SIZE), 0, tiles_y - 1);
+
+    // Bin-Packing 策略
+    int tri_idx = bins.triangles.size();
+    bins.triangles.push_back(tri);
+    for(int ty = t_min_y; ty <= t_max_y; ty++) {
+        for(int tx = t_min_x; tx <= t_max_x; tx++) {
+            bins.tile_commands[ty * tiles_x + tx].push_back({tri_idx, draw_id});
         }
     }
 }
 
 void Rasterizer::draw_entity(const Entity* e) {
     Model* m = modelMgr->get_model(e->get_model_id());
-    mat4 model = e->get_matrix();
 
-    // Set shader context that are common
-    // Helper lambda to update shader based on type
-    auto update_shader = [&](const Mesh& mesh) {
+    // 实体相关的矩阵每次绘制只计算一次，法线矩阵的求逆不再逐顶点进行
+    DrawUniforms uniforms;
+    uniforms.model = e->get_matrix();
+    uniforms.mvp = context.vp * uniforms.model;
+    uniforms.normal_matrix = uniforms.model.inverse_transpose();
+
+    // 每个网格记录一条绘制调用，其上下文在本帧内保持不变
+    for(int i = 0; i < m->nmeshes(); i++) {
+        const Mesh& mesh = m->mesh(i);
         Material* mtl = matMgr->get_material(mesh.material_id);
-        
-        /* 设置模型参数 */
-        context.mtl = mtl;
-        context.model = model;
-        context.mvp = context.vp * context.model;
 
-        currentShader = shaderMgr->get_shader(mtl->shader_id);
-        currentShader->bind_context(&context);
+        DrawCommand cmd;
+        // 绑定材质时按 (shader_id, features) 选出特化版本，片段着色不再查询特性
+        cmd.shader = shaderMgr->get_shader(mtl->shader_id, mtl->features);
+        cmd.context = context;
+        cmd.mesh = &mesh;
+
+        // 需要混合或 G-Buffer 之外插值属性的材质退回前向渲染
+        cmd.deferred = render_path == RenderPath::Deferred && !mtl->alpha_blend &&
+                       !(cmd.shader->varyings() & ~GBUFFER_VARYINGS);
+        has_deferred_draws |= cmd.deferred;
+
+        // 其余不透明的前向绘制参与深度预渲染；混合材质不能遮挡身后的几何
+        cmd.depth_prepass = depth_prepass && !cmd.deferred && !mtl->alpha_blend;
+        has_prepass_draws |= cmd.depth_prepass;
+
+        /* 设置材质参数，并提前解析纹理 */
+        cmd.context.uniforms = uniforms;
+        cmd.context.uniforms.params = mtl->params;
+        cmd.context.uniforms.features = mtl->features;
+        auto resolve = [&](int tex_id) -> const Texture* { return tex_id >= 0 ? texMgr->get_texture(tex_id) : nullptr; };
+        cmd.context.uniforms.diffuse_map = resolve(mtl->diffuse_tex_id);
+        cmd.context.uniforms.normal_map = resolve(mtl->normal_tex_id);
+        cmd.context.uniforms.nm_tangent_map = resolve(mtl->nm_tangent_tex_id);
+        cmd.context.uniforms.specular_map = resolve(mtl->specular_tex_id);
+
+        draw_commands.push_back(cmd);
+    }
+}
+
+// 把全局序列中的 [begin, end) 映射回各绘制调用内部的局部区间
+template<typename First, typename Count, typename Fn>
+static void for_each_draw_range(const std::vector<DrawCommand>& draws, int begin, int end, First first, Count count, Fn fn) {
+    auto it = std::upper_bound(draws.begin(), draws.end(), begin, 
+                               [&](int pos, const DrawCommand& cmd) { return pos < cmd.*first; });
+    for(int d = std::max(0, (int)(it - draws.begin()) - 1); d < draws.size(); d++) {
+        const DrawCommand& cmd = draws[d];
+        if(cmd.*first >= end) break;
+        int local_begin = std::max(begin, cmd.*first) - cmd.*first;
+        int local_end = std::min(end, cmd.*first + count(cmd)) - cmd.*first;
+        if(local_begin < local_end) fn(d, local_begin, local_end);
+    }
+}
+
+void Rasterizer::process_geometry() {
+    // 把整帧所有绘制调用的顶点、面片分别首尾相接，得到全局的顶点序列与面片序列
+    auto vertex_count = [](const DrawCommand& cmd) { return (int)cmd.mesh->vertex_indices.size(); };
+    auto face_count = [](const DrawCommand& cmd) { return (int)cmd.mesh->facet_vertex.size(); };
+    int total_vertices = 0, total_faces = 0;
+    for(auto& cmd : draw_commands) {
+        cmd.first_vertex = total_vertices;
+        cmd.first_face = total_faces;
+        total_vertices += vertex_count(cmd);
+        total_faces += face_count(cmd);
+    }
+    frame_vertices.resize(total_vertices);
+
+    bin_sets.resize(omp_get_max_threads());
+    #pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads();
+        int t = omp_get_thread_num();
+        #pragma omp master
+        geometry_threads = nthreads;
+
+        // 顶点着色：每个唯一顶点只处理一次，写入顶点缓存
+        int begin = (long long)total_vertices * t / nthreads;
+        int end = (long long)total_vertices * (t + 1) / nthreads;
+        for_each_draw_range(draw_commands, begin, end, &DrawCommand::first_vertex, vertex_count, 
+                            [&](int d, int b, int e) { shade_vertices(d, b, e); });
+
+        BinSet& bins = bin_sets[t];
+        bins.triangles.clear();
+        bins.tile_commands.resize(tiles.size());
+        for(auto& commands : bins.tile_commands) commands.clear();
+
+        // 等待全部顶点着色完成后再装配图元
+        #pragma omp barrier
+
+        // 线程 t 负责全局面片序列中连续的第 t 段
+        begin = (long long)total_faces * t / nthreads;
+        end = (long long)total_faces * (t + 1) / nthreads;
+        for_each_draw_range(draw_commands, begin, end, &DrawCommand::first_face, face_count, 
+                            [&](int d, int b, int e) { draw_mesh(d, b, e, bins); });
+    }
+}
+
+void Rasterizer::rasterize_tiles() {
+    const int sample_factor = ssaa * ssaa;
+    if(has_deferred_draws) {
+        gbuffers.resize(omp_get_max_threads());
+        for(auto& g : gbuffers) g.samples.resize(TILE_SIZE * TILE_SIZE * sample_factor);
+    }
+
+    // 按照 Tile 并行渲染，整帧只有一次 fork/join
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < tiles.size(); i++) {
+        // 依次遍历各几何线程的命令列表，即为原始提交顺序
+        auto draw_tile_forward = [&](auto selected) {
+            int bound_draw = -1;
+            for (int t = 0; t < geometry_threads; t++) {
+                const BinSet& bins = bin_sets[t];
+                for (const TileCommand& c : bins.tile_commands[i]) {
+                    DrawCommand& cmd = draw_commands[c.draw];
+                    if (!selected(cmd)) continue;
+                    if (c.draw != bound_draw) {
+                        cmd.shader->bind_context(&cmd.context);
+                        bound_draw = c.draw;
+                    }
+                    RasterPass pass = cmd.depth_prepass ? RasterPass::ColorEqual : RasterPass::Color;
+                    draw_triangle(bins.triangles[c.triangle], tiles[i], c.draw, pass, nullptr);
+                }
+            }
+        };
+
+        // G-Buffer 与深度预渲染中只有不透明几何，结果与提交顺序无关：由近及远绘制，让 Hi-Z 尽早剔除被遮挡的三角形
+        auto draw_tile_front_to_back = [&](auto selected, RasterPass pass, GBufferTile* gbuffer) {
+            std::vector<std::pair<const TriangleCache*, int>> order;
+            for (int t = 0; t < geometry_threads; t++) {
+                const BinSet& bins = bin_sets[t];
+                for (const TileCommand& c : bins.tile_commands[i]) {
+                    if (selected(draw_commands[c.draw])) order.push_back({&bins.triangles[c.triangle], c.draw});
+                }
+            }
+            std::stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first->max_z > b.first->max_z; });
+            for (const auto& [tri, draw] : order) draw_triangle(*tri, tiles[i], draw, pass, gbuffer);
+        };
+
+        // 延迟路径：不透明的几何先写入 Tile 内的 G-Buffer，再对每个可见子采样做一次光照
+        if (has_deferred_draws) {
+            GBufferTile& gbuffer = gbuffers[omp_get_thread_num()];
+            for (auto& sample : gbuffer.samples) sample.draw = -1;
+            gbuffer.primitive_count = 0;
+
+            draw_tile_front_to_back([](const DrawCommand& cmd) { return cmd.deferred; }, RasterPass::Color, &gbuffer);
+            shade_gbuffer(tiles[i], gbuffer);
+        }
+
+        // 深度预渲染：先只写入不透明前向几何的深度，着色时每个可见子采样只执行一次片段着色器
+        if (has_prepass_draws) {
+            draw_tile_front_to_back([](const DrawCommand& cmd) { return cmd.depth_prepass; }, RasterPass::DepthOnly, nullptr);
+        }
+
+        // 前向路径：其余绘制调用 (包括混合材质) 在 G-Buffer 光照之后按深度测试叠加。
+        // 开启预渲染时先着色预渲染过的不透明几何，混合材质随后叠加在其上
+        if (has_prepass_draws) {
+            draw_tile_forward([](const DrawCommand& cmd) { return cmd.depth_prepass; });
+            draw_tile_forward([](const DrawCommand& cmd) { return !cmd.deferred && !cmd.depth_prepass; });
+        } else {
+            draw_tile_forward([](const DrawCommand& cmd) { return !cmd.deferred; });
+        }
+    }
+}
+
+void Rasterizer::shade_gbuffer(const Tile& tile, GBufferTile& gbuffer) {
+    const int sample_factor = ssaa * ssaa;
+    const int x_end = std::min(tile.x_start + TILE_SIZE, width);
+    const int y_end = std::min(tile.y_start + TILE_SIZE, height);
+
+    // 片段包中的每一项对应一个像素内的一组子采样：SSAA 下每组一个子采样，MSAA 下为同一图元覆盖的全部子采样
+    FragmentPacket packet;
+    int packet_pixel[FRAGMENT_PACKET_SIZE];
+    int packet_samples[FRAGMENT_PACKET_SIZE];
+    int packet_draw = -1;
+    packet.count = 0;
+
+    auto flush = [&]() {
+        if(!packet.count) return;
+        DrawCommand& cmd = draw_commands[packet_draw];
+        cmd.shader->bind_context(&cmd.context);
+        packet.discard_mask = 0;
+        cmd.shader->fragment(packet);
+
+        for(int j = 0; j < packet.count; j++) {
+            if(packet.discard_mask >> j & 1) continue;
+            for(int mask = packet_samples[j]; mask; mask &= mask - 1) {
+                set_pixel(packet_pixel[j] + std::countr_zero((unsigned)mask), packet.rgba[j]);
+            }
+        }
+        packet.count = 0;
     };
 
-    for(int i = 0; i < m->nmeshes(); i++) {
-        const Mesh& mesh = m->mesh(i);
-        update_shader(mesh);
-        draw_mesh(mesh);
+    for(int y = tile.y_start; y < y_end; y++) {
+        for(int x = tile.x_start; x < x_end; x++) {
+            const GBufferSample* samples = &gbuffer.samples[((x - tile.x_start) + (y - tile.y_start) * TILE_SIZE) * sample_factor];
+            int pending = 0;
+            for(int k = 0; k < sample_factor; k++) {
+                if(samples[k].draw >= 0) pending |= 1 << k;
+            }
+
+            while(pending) {
+                const GBufferSample& s = samples[std::countr_zero((unsigned)pending)];
+
+                // MSAA 下同一图元在像素内的子采样属性相同，合并为一项只做一次光照
+                int group = pending & -pending;
+                if(msaa) {
+                    for(int m = pending & (pending - 1); m; m &= m - 1) {
+                        const GBufferSample& o = samples[std::countr_zero((unsigned)m)];
+                        if(o.draw == s.draw && o.primitive == s.primitive) group |= m & -m;
+                    }
+                }
+                pending &= ~group;
+
+                if(s.draw != packet_draw || packet.count == FRAGMENT_PACKET_SIZE) {
+                    flush();
+                    packet_draw = s.draw;
+                }
+
+                int j = packet.count++;
+                vec3 n = unpack_unit_vector(s.normal), t = unpack_unit_vector(s.tangent);
+                for(int c = 0; c < 3; c++) {
+                    packet.world_pos[c][j] = s.world_pos[c];
+                    packet.normal[c][j] = n[c];
+                    packet.tangent[c][j] = t[c];
+                }
+                packet.uv[0][j] = s.uv.x;
+                packet.uv[1][j] = s.uv.y;
+                packet.uv_dx[0][j] = s.uv_dx.x;
+                packet.uv_dx[1][j] = s.uv_dx.y;
+                packet.uv_dy[0][j] = s.uv_dy.x;
+                packet.uv_dy[1][j] = s.uv_dy.y;
+                packet_pixel[j] = (x + y * width) * sample_factor;
+                packet_samples[j] = group;
+            }
+        }
     }
+    flush();
 }
 /* ======== 正常 Pass 绘制接口部分 ======== */
 
 /* ======== 深度 Pass 绘制接口部分 ======== */
-void Rasterizer::draw_triangle_depth(const std::array<vec4, 3>& v, std::vector<float>& shadow_buffer) {
-    // Front-Face Culling
+using Box = std::pair<vec3, vec3>; // 轴对齐包围盒 (min, max)
+
+// 包围盒的第 i 个角点 (i 的三个二进制位分别选择 x/y/z 的最大值)
+static vec3 box_corner(const Box& b, int i) {
+    return vec3((i & 1) ? b.second.x : b.first.x, (i & 2) ? b.second.y : b.first.y, (i & 4) ? b.second.z : b.first.z);
+}
+
+// 包围盒的 8 个角点经 m 变换后的包围盒
+static Box transform_box(const mat4& m, const vec3& lo, const vec3& hi) {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    Box box = {vec3(inf, inf, inf), vec3(-inf, -inf, -inf)};
+    for(int i = 0; i < 8; i++) {
+        vec3 p = (m * embed<4>(box_corner({lo, hi}, i), 1.f)).xyz();
+        box.first = min(box.first, p);
+        box.second = max(box.second, p);
+    }
+    return box;
+}
+
+// 相机视锥在视空间深度 [d0, d1] 之间一段的世界空间包围盒
+static Box frustum_slice_box(const Camera& camera, float d0, float d1) {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    const float n = camera.get_near(), f = camera.get_far();
+    mat4 inv_vp = (camera.get_projection_matrix() * camera.get_view_matrix()).invert();
+
+    Box box = {vec3(inf, inf, inf), vec3(-inf, -inf, -inf)};
+    for(float d : {d0, d1}) {
+        float ndc_z = ((n + f) * d - 2.f * n * f) / ((f - n) * d);
+        for(int i = 0; i < 4; i++) {
+            vec4 p = inv_vp * vec4((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, ndc_z, 1.f);
+            vec3 w = p.xyz() / p.w;
+            box.first = min(box.first, w);
+            box.second = max(box.second, w);
+        }
+    }
+    return box;
+}
+
+// 视空间切平面上以 (cx, cy) 为中心、半宽为 s 的正方形区域对应的透视投影，其余约定与 Camera 相同
+static mat4 off_center_projection(float cx, float cy, float s, float n, float f) {
+    mat4 perspective;
+    perspective << 1 / s, 0, cx / s, 0,
+                   0, 1 / s, cy / s, 0,
+                   0, 0, (n + f) / (n - f), 2 * n * f / (n - f),
+                   0, 0, -1, 0;
+    return perspective;
+}
+
+LightShadowMaps Rasterizer::fit_shadow_maps(const Scene& scene, const Light& light) {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+
+    // 全部实体都既是投射者也是接收者
+    std::vector<Box> entity_boxes;
+    Box scene_box = {vec3(inf, inf, inf), vec3(-inf, -inf, -inf)};
+    for(const Entity* e : scene.get_entities()) {
+        const Model* m = modelMgr->get_model(e->get_model_id());
+        entity_boxes.push_back(transform_box(e->get_matrix(), m->get_min_pos(), m->get_max_pos()));
+        scene_box.first = min(scene_box.first, entity_boxes.back().first);
+        scene_box.second = max(scene_box.second, entity_boxes.back().second);
+    }
+
+    // 从光源看向接收者包围盒，拟合出刚好覆盖它的非对称透视投影
+    // 远平面取接收者的最远深度，近平面取与光源视锥相交的投射者的最近深度
+    // 光源离接收者过近，或接收者的张角超过 90° 时，退回以 90° 视角对准接收者中心的投影
+    auto fit = [&](const Box& receivers, ShadowMapData& sd) {
+        vec3 center = (receivers.first + receivers.second) * 0.5f;
+        if((center - light.position).norm() < 1e-4f) center = light.position - vec3(0, 1, 0);
+        Camera light_camera;
+        light_camera.set_eye(light.position).set_target(center).set_up({0, 1, 0});
+        mat4 view = light_camera.get_view_matrix();
+
+        float x_lo = inf, x_hi = -inf, y_lo = inf, y_hi = -inf, d_far = 0;
+        bool fits = true;
+        for(int i = 0; i < 8 && fits; i++) {
+            vec4 v = view * embed<4>(box_corner(receivers, i), 1.f);
+            float d = -v.z;
+            fits = d > zNear;
+            x_lo = std::min(x_lo, v.x / d); x_hi = std::max(x_hi, v.x / d);
+            y_lo = std::min(y_lo, v.y / d); y_hi = std::max(y_hi, v.y / d);
+            d_far = std::max(d_far, d);
+        }
+
+        float cx = 0, cy = 0, s = 1, n = zNear, f = zFar;
+        if(fits) {
+            float s_fit = std::max(x_hi - x_lo, y_hi - y_lo) * 0.5f + SHADOW_FIT_PADDING;
+            if(s_fit < 1.f) {
+                cx = (x_lo + x_hi) * 0.5f;
+                cy = (y_lo + y_hi) * 0.5f;
+                s = s_fit;
+            }
+
+            // 完全落在视锥某个侧面外侧的投射者不可能遮挡接收者
+            float d_near = d_far;
+            for(const Box& b : entity_boxes) {
+                int outside[4] = {0, 0, 0, 0};
+                float box_near = inf;
+                for(int i = 0; i < 8; i++) {
+                    vec4 v = view * embed<4>(box_corner(b, i), 1.f);
+                    float d = -v.z;
+                    outside[0] += v.x < (cx - s) * d;
+                    outside[1] += v.x > (cx + s) * d;
+                    outside[2] += v.y < (cy - s) * d;
+                    outside[3] += v.y > (cy + s) * d;
+                    box_near = std::min(box_near, d);
+                }
+                if(std::max({outside[0], outside[1], outside[2], outside[3]}) == 8) continue;
+                d_near = std::min(d_near, box_near);
+            }
+            n = std::max(zNear, d_near * 0.99f);
+            f = d_far * 1.01f;
+        }
+
+        sd.light_vp = off_center_projection(cx, cy, s, n, f) * view;
+        sd.z_near = n;
+        sd.z_far = f;
+        sd.filter_scale = 1.f / s;
+    };
+
+    // 级联只覆盖相机视锥与场景包围盒重叠的深度范围
+    const Camera& camera = scene.get_camera();
+    mat4 camera_view = camera.get_view_matrix();
+    float view_near = inf, view_far = -inf;
+    for(int i = 0; i < 8; i++) {
+        float d = -(camera_view * embed<4>(box_corner(scene_box, i), 1.f)).z;
+        view_near = std::min(view_near, d);
+        view_far = std::max(view_far, d);
+    }
+    view_near = std::max(view_near, camera.get_near());
+    view_far = std::min(view_far, camera.get_far());
+    if(!(view_near < view_far)) {
+        view_near = camera.get_near();
+        view_far = camera.get_far();
+    }
+
+    LightShadowMaps maps(light.cascades);
+    float split_near = view_near;
+    for(int i = 0; i < light.cascades; i++) {
+        // 对数划分与均匀划分的混合
+        float t = (i + 1.f) / light.cascades;
+        float split_far = (i == light.cascades - 1) ? view_far :
+            CASCADE_SPLIT_LAMBDA * view_near * std::pow(view_far / view_near, t) + (1.f - CASCADE_SPLIT_LAMBDA) * (view_near + (view_far - view_near) * t);
+
+        // 接收者取场景包围盒与这一段视锥包围盒的交集；场景为空或没有交集时退回整个场景
+        Box slice = frustum_slice_box(camera, split_near, split_far);
+        Box receivers = {max(scene_box.first, slice.first), min(scene_box.second, slice.second)};
+        if(!(receivers.first.x <= receivers.second.x && receivers.first.y <= receivers.second.y && receivers.first.z <= receivers.second.z)) {
+            receivers = scene_box;
+        }
+        if(entity_boxes.empty()) receivers = {vec3(0, 0, 0), vec3(0, 0, 0)};
+
+        ShadowMapData& sd = maps[i];
+        sd.width = sd.height = light.shadow_size;
+        sd.split_far = split_far;
+        fit(receivers, sd);
+        split_near = split_far;
+    }
+    return maps;
+}
+
+template<DepthFormat F>
+void Rasterizer::draw_triangle_depth(const std::array<vec4, 3>& v, ShadowMapData& sd, const Tile& tile) {
+    using Depth = DepthTraits<F>;
+    auto* texels = sd.texels<F>();
+
     float total_area = signed_triangle_area(v[0], v[1], v[2]);
-    if(total_area > -1e-5) return;
 
     // 性能小trick: 化除法为乘法
     float inv_total_area = 1.0f / total_area;
     float inv_w1 = 1.f / v[0].w, inv_w2 = 1.f / v[1].w, inv_w3 = 1.f / v[2].w;
 
-    // 计算 AABB 包围盒
+    // 计算 AABB 包围盒，并裁剪到当前 Tile
     auto [min, max] = find_bounding_box(v[0], v[1], v[2]);
-    int min_x = std::clamp((int)std::floor(min.x), 0, sm_width - 1);
-    int max_x = std::clamp((int)std::ceil(max.x), 0, sm_width - 1);
-    int min_y = std::clamp((int)std::floor(min.y), 0, sm_height - 1);
-    int max_y = std::clamp((int)std::ceil(max.y), 0, sm_height - 1);
-
-    // 3. 遍历 AABB 包围盒内的所有像素，不处理 SSAA
-    for(int x = min_x; x <= max_x; x++) {
-        for(int y = min_y; y <= max_y; y++) {
+    int min_x = std::clamp((int)std::floor(min.x), tile.x_start, std::min(tile.x_start + SHADOW_TILE_SIZE, sd.width) - 1);
+    int max_x = std::clamp((int)std::ceil(max.x), tile.x_start, std::min(tile.x_start + SHADOW_TILE_SIZE, sd.width) - 1);
+    int min_y = std::clamp((int)std::floor(min.y), tile.y_start, std::min(tile.y_start + SHADOW_TILE_SIZE, sd.height) - 1);
+    int max_y = std::clamp((int)std::ceil(max.y), tile.y_start, std::min(tile.y_start + SHADOW_TILE_SIZE, sd.height) - 1);
+
+    // 遍历 AABB 包围盒内的所有像素，不处理 SSAA
+    for(int y = min_y; y <= max_y; y++) {
+        for(int x = min_x; x <= max_x; x++) {
             // 采样点设为像素中心
             float px = x + 0.5f;
             float py = y + 0.5f;
@@ -277,80 +1015,171 @@ void Rasterizer::draw_triangle_depth(const std::array<vec4, 3>& v, std::vector<f
                     
             float z = interpolate(alpha_pc, beta_pc, gamma_pc, v[0].z, v[1].z, v[2].z);
             
-            int ind = x + y * sm_width;
-            if(z <= shadow_buffer[ind]) continue; // 深度测试
-            shadow_buffer[ind] = z;
+            // 深度测试按存储格式的精度进行
+            int ind = x + y * sd.width;
+            auto texel = Depth::encode(z);
+            if(Depth::decode(texel) <= Depth::decode(texels[ind])) continue;
+            texels[ind] = texel;
         }
     }
 }
 
-void Rasterizer::draw_mesh_depth_only(const Mesh& mesh, std::vector<float>& depth_buffer) {
-    for (int i = 0; i < mesh.facet_vrt.size(); i++) {
-        std::array<vec4, 3> verts;
-
-        // 仅变换顶点位置
-        verts[0] = currentShader->vertex(mesh, i, 0).pos;
-        verts[1] = currentShader->vertex(mesh, i, 1).pos;
-        verts[2] = currentShader->vertex(mesh, i, 2).pos;
+void Rasterizer::draw_mesh_depth_only(const Mesh& mesh, const ShadowMapData& sd, std::vector<std::array<vec4, 3>>& triangles) {
+    // 仅变换顶点位置，每个唯一顶点只处理一次
+    std::vector<vec4> screen_verts(mesh.vertex_indices.size());
+    for (int i = 0; i < mesh.vertex_indices.size(); i++) {
+        vec4 v = currentShader->vertex(mesh, mesh.vertex_indices[i]).pos;
 
         // Perspective Division & Viewport Transform
-        for(auto& v : verts) {
-            v.x /= v.w; v.y /= v.w; v.z /= v.w;
-            v.x = (v.x + 1.f) * 0.5f * sm_width;
-            v.y = (v.y + 1.f) * 0.5f * sm_height;
-            v.z = (1.f - v.z) * 0.5f;
-        }
+        v.x /= v.w; v.y /= v.w; v.z /= v.w;
+        v.x = (v.x + 1.f) * 0.5f * sd.width;
+        v.y = (v.y + 1.f) * 0.5f * sd.height;
+        v.z = (1.f - v.z) * 0.5f;
+        screen_verts[i] = v;
+    }
+
+    for (int i = 0; i < mesh.facet_vertex.size(); i++) {
+        std::array<vec4, 3> verts;
+        for (int j = 0; j < 3; j++) verts[j] = screen_verts[mesh.facet_vertex[i][j]];
 
-        draw_triangle_depth(verts, depth_buffer);
+        // Front-Face Culling: 在装箱之前剔除
+        if(signed_triangle_area(verts[0], verts[1], verts[2]) > -1e-5) continue;
+        triangles.push_back(verts);
     }
 }
 
-void Rasterizer::execute_depth_pass(const Scene &scene, ShadowMapData &sd) {
-    // 临时替换当前的 VP 矩阵为光源的 VP
-    mat4 old_vp = context.vp;
-    context.vp = sd.light_vp;
-    
-    for(auto e : scene.get_entities()) {
-        Model* m = modelMgr->get_model(e->get_model_id());
-        context.model = e->get_matrix();
-        context.mvp = context.vp * context.model;
+void Rasterizer::render_shadow_maps(const Scene &scene) {
+    const auto& lights = scene.get_lights();
+    const auto& entities = scene.get_entities();
+    const int light_count = lights.size(), entity_count = entities.size();
+    shadow_datas.resize(light_count);
+    shadow_passes.resize(light_count);
+
+    // 缓存检查：只有实体或拟合出的投影发生变化的光源才需要重绘
+    std::vector<std::pair<const Entity*, uint64_t>> revisions;
+    for(const Entity* e : entities) revisions.push_back({e, e->get_revision()});
+    std::vector<std::pair<int, int>> dirty_maps; // (光源, 级联)
+    for(int i = 0; i < light_count; i++) {
+        LightShadowMaps fitted = fit_shadow_maps(scene, lights[i]);
+        ShadowCacheKey key;
+        key.entities = revisions;
+        key.shadow_size = lights[i].shadow_size;
+        key.shadow_format = lights[i].shadow_format;
+        for(const auto& sd : fitted) key.light_vps.push_back(sd.light_vp);
+
+        ShadowPass& pass = shadow_passes[i];
+        if(pass.cached && pass.key == key) continue;
+        pass.key = std::move(key);
+        pass.cached = true;
+        pass.maps.resize(fitted.size());
+        shadow_datas[i] = std::move(fitted);
+        for(int c = 0; c < shadow_datas[i].size(); c++) dirty_maps.push_back({i, c});
+    }
+    if(dirty_maps.empty()) return;
+    const int dirty_count = dirty_maps.size();
+
+    // 每张贴图一份上下文副本，只替换 VP 矩阵，不改动正常渲染的上下文
+    for(auto [i, c] : dirty_maps) {
+        ShadowMapData& sd = shadow_datas[i][c];
+        sd.format = lights[i].shadow_format;
+        sd.buffer.assign(sd.width * sd.height * depth_format_size(sd.format), 0); // 各格式下全零都表示深度 0
+
+        ShadowMapPass& pass = shadow_passes[i].maps[c];
+        pass.context = context;
+        pass.context.vp = sd.light_vp;
+        pass.tiles_x = (sd.width + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+        pass.tiles_y = (sd.height + SHADOW_TILE_SIZE - 1) / SHADOW_TILE_SIZE;
+    }
+
+    // 几何阶段：(贴图, 实体) 两两并行变换，每个任务在自己的上下文副本上绑定实体矩阵
+    std::vector<std::vector<std::array<vec4, 3>>> job_triangles(dirty_count * entity_count);
+    #pragma omp parallel for schedule(dynamic)
+    for(int job = 0; job < dirty_count * entity_count; job++) {
+        auto [light, cascade] = dirty_maps[job / entity_count];
+        const Entity* e = entities[job % entity_count];
+        ShaderContext entity_context = shadow_passes[light].maps[cascade].context;
+        entity_context.uniforms.model = e->get_matrix();
+        entity_context.uniforms.mvp = entity_context.vp * entity_context.uniforms.model;
+        currentShader->bind_context(&entity_context);
 
+        Model* m = modelMgr->get_model(e->get_model_id());
         for(int i = 0; i < m->nmeshes(); i++) {
-            const Mesh& mesh = m->mesh(i);
-            draw_mesh_depth_only(mesh, sd.buffer);
+            draw_mesh_depth_only(m->mesh(i), shadow_datas[light][cascade], job_triangles[job]);
         }
     }
-    
-    context.vp = old_vp; // 还原
-}
 
-void Rasterizer::render_shadow_maps(const Scene &scene) {
-    context.shadow_datas.clear();
-    const auto& lights = scene.get_lights();
+    // 装箱：各贴图互不相关，按贴图并行
+    #pragma omp parallel for schedule(dynamic)
+    for(int d = 0; d < dirty_count; d++) {
+        auto [light, cascade] = dirty_maps[d];
+        const ShadowMapData& sd = shadow_datas[light][cascade];
+        ShadowMapPass& pass = shadow_passes[light].maps[cascade];
+        pass.triangles.clear();
+        pass.tile_triangles.resize(pass.tiles_x * pass.tiles_y);
+        for(auto& list : pass.tile_triangles) list.clear();
 
-    // #pragma omp parallel for
-    for(int i = 0; i < lights.size(); i++) {
-        ShadowMapData sd;
-        sd.buffer.resize(sm_width * sm_height, 0.0f);
-        
-        Camera light_camera;
-        light_camera.set_eye(lights[i].position)
-                    .set_target({0, 0, 0})
-                    .set_up({0, 1, 0})
-                    .set_projection(90.f, (float)sm_width / sm_height, zNear, zFar);
-        sd.light_vp = light_camera.get_projection_matrix() * light_camera.get_view_matrix();
+        for(int j = d * entity_count; j < (d + 1) * entity_count; j++) {
+            for(const auto& v : job_triangles[j]) {
+                auto [min, max] = find_bounding_box(v[0], v[1], v[2]);
+                // 拟合后的贴图只覆盖接收者，完全落在贴图外的三角形直接丢弃
+                if(max.x < 0 || max.y < 0 || min.x > sd.width || min.y > sd.height) continue;
+                int t_min_x = std::clamp((int)std::floor(min.x), 0, sd.width - 1) / SHADOW_TILE_SIZE;
+                int t_max_x = std::clamp((int)std::ceil(max.x), 0, sd.width - 1) / SHADOW_TILE_SIZE;
+                int t_min_y = std::clamp((int)std::floor(min.y), 0, sd.height - 1) / SHADOW_TILE_SIZE;
+                int t_max_y = std::clamp((int)std::ceil(max.y), 0, sd.height - 1) / SHADOW_TILE_SIZE;
+
+                int tri_idx = pass.triangles.size();
+                pass.triangles.push_back(v);
+                for(int ty = t_min_y; ty <= t_max_y; ty++) {
+                    for(int tx = t_min_x; tx <= t_max_x; tx++) {
+                        pass.tile_triangles[ty * pass.tiles_x + tx].push_back(tri_idx);
+                    }
+                }
+            }
+        }
+    }
 
-        // 执行深度 Pass
-        execute_depth_pass(scene, sd);
-        context.shadow_datas.push_back(std::move(sd));
+    // 光栅化：(贴图, Tile) 两两并行，每块阴影贴图区域只由一个线程写入
+    // 深度 Pass 只保留最大深度，结果与三角形的处理顺序无关
+    std::vector<std::pair<int, int>> tile_jobs; // (dirty_maps 中的序号, Tile)
+    for(int d = 0; d < dirty_count; d++) {
+        const ShadowMapPass& pass = shadow_passes[dirty_maps[d].first].maps[dirty_maps[d].second];
+        for(int t = 0; t < pass.tiles_x * pass.tiles_y; t++) tile_jobs.push_back({d, t});
     }
+    #pragma omp parallel for schedule(dynamic)
+    for(int job = 0; job < tile_jobs.size(); job++) {
+        auto [d, t] = tile_jobs[job];
+        auto [light, cascade] = dirty_maps[d];
+        const ShadowMapPass& pass = shadow_passes[light].maps[cascade];
+        Tile tile = {(t % pass.tiles_x) * SHADOW_TILE_SIZE, (t / pass.tiles_x) * SHADOW_TILE_SIZE};
+        ShadowMapData& sd = shadow_datas[light][cascade];
+        visit_depth_format(sd.format, [&](auto f) {
+            for(int tri_idx : pass.tile_triangles[t]) {
+                draw_triangle_depth<f>(pass.triangles[tri_idx], sd, tile);
+            }
+        });
+    }
+
+    // 预滤波类的阴影策略在深度图更新后处理一次
+    for(auto [i, c] : dirty_maps) shadow_strategy->prefilter(shadow_datas[i][c]);
 }
 /* ======== 深度 Pass 绘制接口部分 ======== */
 
 void Rasterizer::draw(const Scene& scene) {
-    // Pass 1: 生成光源深度图
+    // 阴影算法由场景选择；预滤波的结果随深度图一起缓存，切换算法时需要全部重绘
+    if(!shadow_strategy || scene.get_shadow_filter() != shadow_filter || scene.get_shadow_blur_radius() != shadow_blur_radius) {
+        shadow_filter = scene.get_shadow_filter();
+        shadow_blur_radius = scene.get_shadow_blur_radius();
+        switch(shadow_filter) {
+            case ShadowFilter::Hard: shadow_strategy = std::make_unique<HardShadowStrategy>(); break;
+            case ShadowFilter::PCSS: shadow_strategy = std::make_unique<PCSSShadowStrategy>(); break;
+            case ShadowFilter::VSM: shadow_strategy = std::make_unique<VSMShadowStrategy>(shadow_blur_radius); break;
+        }
+        invalidate_shadow_maps();
+    }
+
+    // Pass 1: 生成光源深度图 (光源与实体都没有变化时直接复用上一帧的结果)
     currentShader = shaderMgr->get_shader("depth_only");
-    currentShader->bind_context(&context);
     render_shadow_maps(scene);
 
     // 设置通用渲染上下文
@@ -359,10 +1188,21 @@ void Rasterizer::draw(const Scene& scene) {
     context.vp = camera.get_projection_matrix() * camera.get_view_matrix();
     context.lights = &scene.get_lights();
     context.texMgr = texMgr;
-    context.shadow_strategy = std::make_unique<PCSSShadowStrategy>();
+    context.shadow_datas = &shadow_datas;
+    context.shadow_strategy = shadow_strategy.get();
 
     // Pass 2: 正常渲染
+    // 几何阶段：所有实体的三角形统一并行变换，并装箱到各 Tile 的命令列表
+    render_path = scene.get_render_path();
+    depth_prepass = scene.get_depth_prepass();
+    has_deferred_draws = false;
+    has_prepass_draws = false;
+    draw_commands.clear();
     for(auto e : scene.get_entities()) draw_entity(e);
+    process_geometry();
+
+    // 光栅化阶段：每个 Tile 每帧只光栅化一次；延迟路径的光照在 Tile 内紧随其后完成
+    rasterize_tiles();
 }
 
 
@@ -371,9 +1211,9 @@ TGAImage Rasterizer::to_tga_image(Buffers buffer) {
     switch(buffer) {
         case Buffers::Color: {
             img = TGAImage(width, height, TGAImage::RGBA);
-            // #pragma omp parallel for schedule(static)
+            std::vector<vec4> resolved = resolve_samples(framebuffer, ssaa * ssaa, width * height);
             for(int i = 0; i < width * height; i++) {
-                vec4 avg = get_avg(i, ssaa, framebuffer).clamp(0.0f, 1.0f);
+                vec4 avg = resolved[i].clamp(0.0f, 1.0f);
                 img.set(i % width, i / width, {static_cast<uint8_t>(avg.z * 255), 
                                                static_cast<uint8_t>(avg.y * 255), 
                                                static_cast<uint8_t>(avg.x * 255), 
@@ -383,9 +1223,9 @@ TGAImage Rasterizer::to_tga_image(Buffers buffer) {
         }
         case Buffers::Depth: {
             img = TGAImage(width, height, TGAImage::GRAYSCALE);
-            // #pragma omp parallel for schedule(static)
+            std::vector<float> resolved = resolve_samples(zbuffer, ssaa * ssaa, width * height);
             for(int i = 0; i < width * height; i++) {
-                float avg = std::clamp(get_avg(i, ssaa, zbuffer), 0.0f, 1.0f);
+                float avg = std::clamp(resolved[i], 0.0f, 1.0f);
                 img.set(i % width, i / width, {static_cast<uint8_t>(avg * 255)});
             }
             break;
@@ -1,27 +1,30 @@
 #include "shader.h"
 #include <algorithm>
 #include <cmath>
+#include <limits>
 
-vec4 IShader::get_diffuse_color(const vec2& uv) const {
+template<bool UseMap>
+vec4 IShader::get_diffuse_color(const vec2& uv, const vec2& duv_dx, const vec2& duv_dy) const {
     float alpha = 1.f;
-    vec3 result_color = context->mtl->params.diffuse_color;
-    if(context->mtl->has_feature(Material::USE_DIFFUSE_MAP)) {
-        Texture* diffuse_map = context->texMgr->get_texture(context->mtl->diffuse_tex_id);
+    vec3 result_color = context->uniforms.params.diffuse_color;
+    if constexpr (UseMap) {
+        const Texture* diffuse_map = context->uniforms.diffuse_map;
         assert(diffuse_map && "Diffuse map is nullptr");
-        TGAColor diffuse_color = diffuse_map->sample_uv(uv);
-        result_color =  result_color * vec3(diffuse_color[2], diffuse_color[1], diffuse_color[0]) / 255.f;
-        alpha = diffuse_color.bytespp == 4 ? diffuse_color[3] / 255.f : 1.f;
+        vec4 diffuse_color = diffuse_map->sample_grad(uv, duv_dx, duv_dy);
+        result_color =  result_color * diffuse_color.xyz();
+        alpha = diffuse_color.w; // 不带 Alpha 通道的贴图转换时已填充为 1
     }
     return embed<4>(result_color, alpha);
 }
 
-vec3 IShader::get_specular_color(const vec2& uv) const {
+template<bool UseMap>
+vec3 IShader::get_specular_color(const vec2& uv, const vec2& duv_dx, const vec2& duv_dy) const {
     vec3 result_color = vec3(1.f, 1.f, 1.f);
-    if(context->mtl->has_feature(Material::USE_SPECULAR_MAP)) {
-        Texture* specular_map = context->texMgr->get_texture(context->mtl->specular_tex_id);
+    if constexpr (UseMap) {
+        const Texture* specular_map = context->uniforms.specular_map;
         assert(specular_map && "Specular map is nullptr");
-        TGAColor specular_color = specular_map->sample_uv(uv);
-        result_color =  result_color * vec3(specular_color[0], specular_color[0], specular_color[0]) / 255.f;
+        vec4 specular_color = specular_map->sample_grad(uv, duv_dx, duv_dy);
+        result_color =  result_color * vec3(specular_color.z, specular_color.z, specular_color.z); // 取蓝色通道 (灰度图三个通道相同)
     }
     return result_color;
 }
@@ -63,85 +66,81 @@ vec3 IShader::compute_lighting(const vec3& point, const vec3& normal, const vec3
     return result_color;
 }
 
-Vertex FlatShader::vertex(const Mesh& mesh, int iface, int nthvert) {
+Vertex FlatShader::vertex(const Mesh& mesh, const VertexIndex& idx) {
     Vertex v;
-    vec3 vertex_pos = mesh.verts[mesh.facet_vrt[iface][nthvert]];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
+    vec3 vertex_pos = mesh.verts[idx.vrt];
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
+    v.world_pos = (context->uniforms.model * embed<4>(vertex_pos, 1.f)).xyz();
+    return v;
+}
 
-    static vec3 color = {0.0f, 0.0f, 0.0f}; 
-    
+void FlatShader::face(const Mesh& mesh, int iface, std::array<Vertex, 3>& verts) {
     // Calculate per-face normal and representative point once per face
-    if (iface != last_face_idx) {
-        // 1. Calculate world space coords
-        vec3 p0 = (context->model * embed<4>(mesh.verts[mesh.facet_vrt[iface][0]], 1.f)).xyz();
-        vec3 p1 = (context->model * embed<4>(mesh.verts[mesh.facet_vrt[iface][1]], 1.f)).xyz();
-        vec3 p2 = (context->model * embed<4>(mesh.verts[mesh.facet_vrt[iface][2]], 1.f)).xyz();
-        
-        // 2. Face normal
-        face_normal = cross_product(p1 - p0, p2 - p0).normalized();
-        
-        // 3. Centroid
-        vec3 centroid = (p0 + p1 + p2) / 3.0f;
-
-        // 4. Compute lighting once per face
-        color = compute_lighting(centroid, face_normal, vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), context->mtl->params.ambient, context->mtl->params.diffuse, context->mtl->params.specular, context->mtl->params.shininess); 
+    // 1. World space coords come from the vertex cache
+    vec3 p0 = verts[0].world_pos, p1 = verts[1].world_pos, p2 = verts[2].world_pos;
+    
+    // 2. Face normal
+    vec3 face_normal = cross_product(p1 - p0, p2 - p0).normalized();
+    
+    // 3. Centroid
+    vec3 centroid = (p0 + p1 + p2) / 3.0f;
 
-        last_face_idx = iface;
-    }
+    // 4. Compute lighting once per face
+    vec3 color = compute_lighting(centroid, face_normal, vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), context->uniforms.params.ambient, context->uniforms.params.diffuse, context->uniforms.params.specular, context->uniforms.params.shininess); 
     
     // Use calculated face color
-    v.color = color; 
-    
-    return v;
+    for(auto& v : verts) v.color = color; 
 }
 
-bool FlatShader::fragment(const Vertex& v, vec4& rgba) {
-    rgba = embed<4>(v.color, 1.f); // 直接使用顶点传过来的颜色（由于三个顶点颜色相同，插值结果也是恒定的）
-    return false;
+void FlatShader::fragment(FragmentPacket& packet) {
+    for(int i = 0; i < packet.count; i++) {
+        packet.rgba[i] = embed<4>(packet.get_color(i), 1.f); // 直接使用顶点传过来的颜色（由于三个顶点颜色相同，插值结果也是恒定的）
+    }
 }
 
 // Gouraud Shader Implementation
-Vertex GouraudShader::vertex(const Mesh& mesh, int iface, int nthvert) {
+Vertex GouraudShader::vertex(const Mesh& mesh, const VertexIndex& idx) {
     Vertex v;
-    int idx_vert = mesh.facet_vrt[iface][nthvert];
-    int idx_norm = mesh.facet_nrm[iface][nthvert];
+    int idx_vert = idx.vrt;
+    int idx_norm = idx.nrm;
 
     vec3 vertex_pos = mesh.verts[idx_vert];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
     
-    vec3 world_pos = (context->model * embed<4>(vertex_pos, 1.f)).xyz();
+    vec3 world_pos = (context->uniforms.model * embed<4>(vertex_pos, 1.f)).xyz();
     v.world_pos = world_pos;
     
     vec3 normal = mesh.norms[idx_norm];
-    mat<4> normal_matrix = context->model.inverse_transpose();
+    const mat4& normal_matrix = context->uniforms.normal_matrix;
     v.normal = (normal_matrix * embed<4>(normal)).xyz().normalized();
     
     v.color = compute_lighting(world_pos, v.normal, vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), 
-                                context->mtl->params.ambient, 
-                                context->mtl->params.diffuse, 
-                                context->mtl->params.specular, 
-                                context->mtl->params.shininess);
+                                context->uniforms.params.ambient, 
+                                context->uniforms.params.diffuse, 
+                                context->uniforms.params.specular, 
+                                context->uniforms.params.shininess);
     v.uv = {0, 0};
     return v;
 }
 
-bool GouraudShader::fragment(const Vertex& v, vec4& rgba) {
-    rgba = embed<4>(v.color, 1.f);
-    return false;
+void GouraudShader::fragment(FragmentPacket& packet) {
+    for(int i = 0; i < packet.count; i++) {
+        packet.rgba[i] = embed<4>(packet.get_color(i), 1.f);
+    }
 }
 
 // Phong Shader Implementation
-Vertex PhongShader::vertex(const Mesh& mesh, int iface, int nthvert) {
+Vertex PhongShader::vertex(const Mesh& mesh, const VertexIndex& idx) {
     Vertex v;
-    int idx_vert = mesh.facet_vrt[iface][nthvert];
-    int idx_norm = mesh.facet_nrm[iface][nthvert];
+    int idx_vert = idx.vrt;
+    int idx_norm = idx.nrm;
     
     vec3 vertex_pos = mesh.verts[idx_vert];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
-    v.world_pos = (context->model * embed<4>(vertex_pos, 1.f)).xyz();
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
+    v.world_pos = (context->uniforms.model * embed<4>(vertex_pos, 1.f)).xyz();
     
     vec3 normal = mesh.norms[idx_norm];
-    mat<4> normal_matrix = context->model.inverse_transpose();
+    const mat4& normal_matrix = context->uniforms.normal_matrix;
     v.normal = (normal_matrix * embed<4>(normal)).xyz().normalized();
     
     v.color = {0, 0, 0}; // Not used
@@ -149,65 +148,68 @@ Vertex PhongShader::vertex(const Mesh& mesh, int iface, int nthvert) {
     return v;
 }
 
-bool PhongShader::fragment(const Vertex& v, vec4& rgba) {
-    vec3 n = v.normal.normalized();
-    vec3 color = compute_lighting(v.world_pos, n, vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), 
-                                    context->mtl->params.ambient, 
-                                    context->mtl->params.diffuse,
-                                    context->mtl->params.specular, 
-                                    context->mtl->params.shininess);
-    rgba = embed<4>(color, 1.f);
-    return false;
+void PhongShader::fragment(FragmentPacket& packet) {
+    for(int i = 0; i < packet.count; i++) {
+        vec3 n = packet.get_normal(i).normalized();
+        vec3 color = compute_lighting(packet.get_world_pos(i), n, vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), 
+                                        context->uniforms.params.ambient, 
+                                        context->uniforms.params.diffuse,
+                                        context->uniforms.params.specular, 
+                                        context->uniforms.params.shininess);
+        packet.rgba[i] = embed<4>(color, 1.f);
+    }
 }
 
-Vertex NormalShader::vertex(const Mesh &mesh, int iface, int nthvert) {
+Vertex NormalShader::vertex(const Mesh& mesh, const VertexIndex& idx) {
     Vertex v;
-    int idx_vert = mesh.facet_vrt[iface][nthvert];
-    int idx_uv = mesh.facet_uv[iface][nthvert];
+    int idx_vert = idx.vrt;
+    int idx_uv = idx.uv;
 
     vec3 vertex_pos = mesh.verts[idx_vert];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
-    v.world_pos = (context->model * embed<4>(vertex_pos, 1.f)).xyz();
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
+    v.world_pos = (context->uniforms.model * embed<4>(vertex_pos, 1.f)).xyz();
 
     v.uv = mesh.uvs[idx_uv];
 
     return v;
 }
 
-bool NormalShader::fragment(const Vertex& v, vec4& rgba) {
-    Texture* normal_map = context->texMgr->get_texture(context->mtl->normal_tex_id);
+void NormalShader::fragment(FragmentPacket& packet) {
+    const Texture* normal_map = context->uniforms.normal_map;
     assert(normal_map && "Normal map is nullptr");
     
-    TGAColor normal_color = normal_map->sample_uv(v.uv);
-    vec3 n = vec3(normal_color[2], normal_color[1], normal_color[0]) / 255.f * 2.f - vec3(1, 1, 1);
-
-    vec3 color = compute_lighting(v.world_pos, n.normalized(), vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), 
-                                    context->mtl->params.ambient, 
-                                    context->mtl->params.diffuse, 
-                                    context->mtl->params.specular, 
-                                    context->mtl->params.shininess);
-    rgba = embed<4>(color, 1.f);
-    return false;
+    for(int i = 0; i < packet.count; i++) {
+        vec4 normal_color = normal_map->sample_grad(packet.get_uv(i), packet.get_uv_dx(i), packet.get_uv_dy(i));
+        vec3 n = normal_color.xyz() * 2.f - vec3(1, 1, 1);
+
+        vec3 color = compute_lighting(packet.get_world_pos(i), n.normalized(), vec3(1.f, 1.f, 1.f), vec3(1.f, 1.f, 1.f), 
+                                        context->uniforms.params.ambient, 
+                                        context->uniforms.params.diffuse, 
+                                        context->uniforms.params.specular, 
+                                        context->uniforms.params.shininess);
+        packet.rgba[i] = embed<4>(color, 1.f);
+    }
 }
 
-Vertex StandardShader::vertex(const Mesh& mesh, int iface, int nthvert) {
+template<int Features>
+Vertex StandardShader<Features>::vertex(const Mesh& mesh, const VertexIndex& idx) {
     Vertex v;
-    int idx_vert = mesh.facet_vrt[iface][nthvert];
-    int idx_uv = mesh.facet_uv[iface][nthvert];
-    int idx_norm = mesh.facet_nrm[iface][nthvert];
+    int idx_vert = idx.vrt;
+    int idx_uv = idx.uv;
+    int idx_norm = idx.nrm;
 
     vec3 vertex_pos = mesh.verts[idx_vert];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
-    v.world_pos = (context->model * embed<4>(vertex_pos, 1.f)).xyz();
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
+    v.world_pos = (context->uniforms.model * embed<4>(vertex_pos, 1.f)).xyz();
 
     v.uv = mesh.uvs[idx_uv];
 
     vec3 normal = mesh.norms[idx_norm];
-    mat<4> normal_matrix = context->model.inverse_transpose();
+    const mat4& normal_matrix = context->uniforms.normal_matrix;
     v.normal = (normal_matrix * embed<4>(normal)).xyz().normalized();
 
-    if(context->mtl->has_feature(Material::USE_NM_TANGENT_MAP)) {
-        v.tangent = (context->model * embed<4>(mesh.tangents[idx_vert])).xyz().normalized();
+    if constexpr (use_nm_tangent_map) {
+        v.tangent = (context->uniforms.model * embed<4>(mesh.tangents[idx_vert])).xyz().normalized();
 
         // 施密特正交化保证「切线」与「法线」垂直!
         v.tangent = (v.tangent - v.normal * dot_product(v.tangent, v.normal)).normalized();
@@ -217,157 +219,223 @@ Vertex StandardShader::vertex(const Mesh& mesh, int iface, int nthvert) {
     return v;
 }
 
-bool StandardShader::fragment(const Vertex& v, vec4& rgba) {
-    vec3 n;
-    if(context->mtl->has_feature(Material::USE_NORMAL_MAP)) {
-        Texture* normal_map = context->texMgr->get_texture(context->mtl->normal_tex_id);
-        assert(normal_map && "Normal map is nullptr");
-
-        TGAColor normal_color = normal_map->sample_uv(v.uv);
-        n = vec3(normal_color[2], normal_color[1], normal_color[0]) / 255.f * 2.f - vec3(1, 1, 1);
-    } 
-    else if(context->mtl->has_feature(Material::USE_NM_TANGENT_MAP)) {
-        Texture* tangent_map = context->texMgr->get_texture(context->mtl->nm_tangent_tex_id);
-        assert(tangent_map && "Normal Tangent map is nullptr");
-        
-        TGAColor tangent_color = tangent_map->sample_uv(v.uv);
-        n = vec3(tangent_color[2], tangent_color[1], tangent_color[0]) / 255.f * 2.f - vec3(1, 1, 1);
-
-        // 重新规范化插值后的基向量
-        vec3 normal = v.normal.normalized();
-        vec3 tangent = v.tangent.normalized();
+template<int Features>
+void StandardShader<Features>::shade(FragmentPacket& packet, const vec3& normal_offset) {
+    // 贴图指针与材质参数在整批片段内不变
+    const DrawUniforms& uniforms = context->uniforms;
+    const Texture* normal_map = uniforms.normal_map;
+    const Texture* tangent_map = uniforms.nm_tangent_map;
+    if constexpr (use_normal_map) assert(normal_map && "Normal map is nullptr");
+    else if constexpr (use_nm_tangent_map) assert(tangent_map && "Normal Tangent map is nullptr");
+
+    for(int i = 0; i < packet.count; i++) {
+        vec2 uv = packet.get_uv(i), duv_dx = packet.get_uv_dx(i), duv_dy = packet.get_uv_dy(i);
+        vec3 n;
+        if constexpr (use_normal_map) {
+            vec4 normal_color = normal_map->sample_grad(uv, duv_dx, duv_dy);
+            n = normal_color.xyz() * 2.f - vec3(1, 1, 1);
+        } 
+        else if constexpr (use_nm_tangent_map) {
+            vec4 tangent_color = tangent_map->sample_grad(uv, duv_dx, duv_dy);
+            n = tangent_color.xyz() * 2.f - vec3(1, 1, 1);
+
+            // 重新规范化插值后的基向量
+            vec3 normal = (packet.get_normal(i) + normal_offset).normalized();
+            vec3 tangent = packet.get_tangent(i).normalized();
+            
+            // 由于做了插值，所以还要再做一次施密特正交化
+            tangent = (tangent - normal * dot_product(tangent, normal)).normalized();
+            vec3 bitangent = cross_product(normal, tangent).normalized();
+
+            // 构建TBN矩阵并将法线转换到世界空间
+            mat<3> tbn = mat<3>(tangent, bitangent, normal).transpose();
+            n = tbn * n;
+        } 
+        else {
+            n = packet.get_normal(i);
+        }
+        vec4 diffuse_color = get_diffuse_color<use_diffuse_map>(uv, duv_dx, duv_dy);
+        vec3 specular_color = get_specular_color<use_specular_map>(uv, duv_dx, duv_dy);
         
-        // 由于做了插值，所以还要再做一次施密特正交化
-        tangent = (tangent - normal * dot_product(tangent, normal)).normalized();
-        vec3 bitangent = cross_product(normal, tangent).normalized();
-
-        // 构建TBN矩阵并将法线转换到世界空间
-        mat<3> tbn = mat<3>(tangent, bitangent, normal).transpose();
-        n = tbn * n;
-    } 
-    else {
-        n = v.normal;
+        vec3 color = compute_lighting(packet.get_world_pos(i), n.normalized(), diffuse_color.xyz(), specular_color, uniforms.params.ambient, uniforms.params.diffuse, uniforms.params.specular, uniforms.params.shininess);
+        packet.rgba[i] = embed<4>(color, diffuse_color.w);
     }
-    vec4 diffuse_color = get_diffuse_color(v.uv);
-    vec3 specular_color = get_specular_color(v.uv);
-    
-    vec3 color = compute_lighting(v.world_pos, n.normalized(), diffuse_color.xyz(), specular_color, context->mtl->params.ambient, context->mtl->params.diffuse, context->mtl->params.specular, context->mtl->params.shininess);
-    rgba = embed<4>(color, diffuse_color.w);
+}
 
-    return false;
+template<int Features>
+void StandardShader<Features>::fragment(FragmentPacket& packet) {
+    shade(packet, vec3(0, 0, 0));
 }
 
-Vertex EyeShader::vertex(const Mesh& mesh, int iface, int nthvert) {
-    Vertex v;
-    int idx_vert = mesh.facet_vrt[iface][nthvert];
-    int idx_uv = mesh.facet_uv[iface][nthvert];
-    int idx_norm = mesh.facet_nrm[iface][nthvert];
+/* TODO: 还需要后续完善 EyeShader 的 fragment 函数 */
+template<int Features>
+void EyeShader<Features>::fragment(FragmentPacket& packet) {
+    this->shade(packet, vec3(0, 0, 0.1f));
+}
 
-    vec3 vertex_pos = mesh.verts[idx_vert];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
-    v.world_pos = (context->model * embed<4>(vertex_pos, 1.f)).xyz();
+/* 为 Material::Feature 的全部组合显式实例化，ShaderManager::register_variants 按掩码取用 */
+static_assert(Material::FEATURE_COMBINATIONS == 16, "update the feature variant instantiations below");
+#define INSTANTIATE_FEATURE_VARIANTS(Shader) \
+    template class Shader<0>;  template class Shader<1>;  template class Shader<2>;  template class Shader<3>;  \
+    template class Shader<4>;  template class Shader<5>;  template class Shader<6>;  template class Shader<7>;  \
+    template class Shader<8>;  template class Shader<9>;  template class Shader<10>; template class Shader<11>; \
+    template class Shader<12>; template class Shader<13>; template class Shader<14>; template class Shader<15>;
 
-    v.uv = mesh.uvs[idx_uv];
+INSTANTIATE_FEATURE_VARIANTS(StandardShader)
+INSTANTIATE_FEATURE_VARIANTS(EyeShader)
 
-    vec3 normal = mesh.norms[idx_norm];
-    mat<4> normal_matrix = context->model.inverse_transpose();
-    v.normal = (normal_matrix * embed<4>(normal)).xyz().normalized();
+#undef INSTANTIATE_FEATURE_VARIANTS
 
-    if(context->mtl->has_feature(Material::USE_NM_TANGENT_MAP)) {
-        v.tangent = (context->model * embed<4>(mesh.tangents[idx_vert])).xyz().normalized();
+Vertex DepthShader::vertex(const Mesh& mesh, const VertexIndex& idx) {
+    Vertex v;
 
-        // 施密特正交化保证「切线」与「法线」垂直!
-        v.tangent = (v.tangent - v.normal * dot_product(v.tangent, v.normal)).normalized();
-        v.bitangent = cross_product(v.normal, v.tangent).normalized();
-    }
+    // 只做 MVP 变换，不考虑光照模型
+    vec3 vertex_pos = mesh.verts[idx.vrt];
+    v.pos = context->uniforms.mvp * embed<4>(vertex_pos, 1.f);
 
     return v;
 }
 
-/* TODO: 还需要后续完善 EyeShader 的 fragment 函数 */
-bool EyeShader::fragment(const Vertex& v, vec4& rgba) {
-    vec3 n;
-    if(context->mtl->has_feature(Material::USE_NORMAL_MAP)) {
-        Texture* normal_map = context->texMgr->get_texture(context->mtl->normal_tex_id);
-        assert(normal_map && "Normal map is nullptr");
-
-        TGAColor normal_color = normal_map->sample_uv(v.uv);
-        n = vec3(normal_color[2], normal_color[1], normal_color[0]) / 255.f * 2.f - vec3(1, 1, 1);
-    } 
-    else if(context->mtl->has_feature(Material::USE_NM_TANGENT_MAP)) {
-        Texture* tangent_map = context->texMgr->get_texture(context->mtl->nm_tangent_tex_id);
-        assert(tangent_map && "Normal Tangent map is nullptr");
-        
-        TGAColor tangent_color = tangent_map->sample_uv(v.uv);
-        n = vec3(tangent_color[2], tangent_color[1], tangent_color[0]) / 255.f * 2.f - vec3(1, 1, 1);
+void DepthShader::fragment(FragmentPacket& packet) {
+    // 仅写入深度，不计算像素颜色
+}
 
-        // 重新规范化插值后的基向量
-        vec3 normal = (v.normal + vec3(0, 0, 0.1f)).normalized();
-        vec3 tangent = v.tangent.normalized();
-        
-        // 由于做了插值，所以还要再做一次施密特正交化
-        tangent = (tangent - normal * dot_product(tangent, normal)).normalized();
-        vec3 bitangent = cross_product(normal, tangent).normalized();
-
-        // 构建TBN矩阵并将法线转换到世界空间
-        mat<3> tbn = mat<3>(tangent, bitangent, normal).transpose();
-        n = tbn * n;
-    } 
-    else {
-        n = v.normal;
-    }
-    vec4 diffuse_color = get_diffuse_color(v.uv);
-    vec3 specular_color = get_specular_color(v.uv);
-    
-    vec3 color = compute_lighting(v.world_pos, n.normalized(), diffuse_color.xyz(), specular_color, context->mtl->params.ambient, context->mtl->params.diffuse, context->mtl->params.specular, context->mtl->params.shininess);
-    rgba = embed<4>(color, diffuse_color.w);
+const ShadowMapData& IShadowStrategy::select_shadow_map(int light_idx, const vec3& world_pos, const ShaderContext* context) {
+    const auto& maps = (*context->shadow_datas)[light_idx];
+    if(maps.size() == 1) return maps[0];
 
-    return false;
+    // 透视投影下裁剪空间的 w 即视空间深度
+    vec4 row = context->vp[3];
+    float view_depth = row.x * world_pos.x + row.y * world_pos.y + row.z * world_pos.z + row.w;
+    for(const auto& sd : maps) {
+        if(view_depth <= sd.split_far) return sd;
+    }
+    return maps.back();
 }
 
-Vertex DepthShader::vertex(const Mesh &mesh, int iface, int nthvert) {
-    Vertex v;
-
-    // 只做 MVP 变换，不考虑光照模型
-    vec3 vertex_pos = mesh.verts[mesh.facet_vrt[iface][nthvert]];
-    v.pos = context->mvp * embed<4>(vertex_pos, 1.f);
+void IShadowStrategy::build_depth_mips(ShadowMapData& sd) {
+    sd.depth_mips.clear();
+
+    // 按行做 2x2 归约，奇数边长时越界的子 texel 取边缘值；fetch(i) 返回上一层第 i 个 texel 的深度或深度范围
+    auto reduce = [](auto fetch, int src_w, int src_h, DepthRangeMip& mip) {
+        #pragma omp parallel for schedule(static)
+        for(int y = 0; y < mip.height; y++) {
+            const int row0 = (2 * y) * src_w;
+            const int row1 = std::min(2 * y + 1, src_h - 1) * src_w;
+            vec2* out = &mip.range[y * mip.width];
+            for(int x = 0; x < mip.width; x++) {
+                int x0 = 2 * x, x1 = std::min(2 * x + 1, src_w - 1);
+                vec2 a = min_max(fetch(row0 + x0), fetch(row0 + x1)), b = min_max(fetch(row1 + x0), fetch(row1 + x1));
+                out[x] = vec2(std::min(a.x, b.x), std::max(a.y, b.y));
+            }
+        }
+    };
+
+    int src_w = sd.width, src_h = sd.height;
+    while(src_w > 1 || src_h > 1) {
+        DepthRangeMip mip;
+        mip.width = (src_w + 1) / 2;
+        mip.height = (src_h + 1) / 2;
+        mip.range.resize(mip.width * mip.height);
+
+        // 第一层直接归约深度图，之后逐层归约上一层
+        if(sd.depth_mips.empty()) {
+            visit_depth_format(sd.format, [&](auto f) {
+                reduce([&](int i) { return sd.depth<f>(i); }, src_w, src_h, mip);
+            });
+        } else {
+            const vec2* prev = sd.depth_mips.back().range.data();
+            reduce([prev](int i) { return prev[i]; }, src_w, src_h, mip);
+        }
 
-    return v;
+        src_w = mip.width;
+        src_h = mip.height;
+        sd.depth_mips.push_back(std::move(mip));
+    }
 }
 
-bool DepthShader::fragment(const Vertex& v, vec4& rgba) {
-    return false; // 仅写入深度，丢弃像素颜色
+template<DepthFormat F>
+vec2 IShadowStrategy::depth_range(const ShadowMapData& sd, vec2 uv, float radius) {
+    constexpr float inf = std::numeric_limits<float>::infinity();
+
+    // 与 sample_buffer_bilinear 相同的 texel 坐标，双线性采样还会读取右侧 (下方) 相邻的 texel
+    auto texel_span = [](float lo, float hi, int size, int& t0, int& t1) {
+        t0 = (int)std::floor(std::clamp(lo * (size - 1), 0.f, (float)(size - 1)));
+        t1 = std::min((int)std::floor(std::clamp(hi * (size - 1), 0.f, (float)(size - 1))) + 1, size - 1);
+    };
+    int x0, x1, y0, y1;
+    texel_span(uv.x - radius, uv.x + radius, sd.width, x0, x1);
+    texel_span(uv.y - radius, uv.y + radius, sd.height, y0, y1);
+
+    // 选择区域最多跨越 2x2 个 texel 的最精细层级，level 0 即深度图本身，level i 对应 depth_mips[i - 1]
+    int level = 0;
+    while(level < (int)sd.depth_mips.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1)) {
+        level++;
+    }
+
+    vec2 range(inf, -inf);
+    for(int y = y0 >> level; y <= y1 >> level; y++) {
+        for(int x = x0 >> level; x <= x1 >> level; x++) {
+            vec2 r;
+            if(level) {
+                const auto& mip = sd.depth_mips[level - 1];
+                r = mip.range[x + y * mip.width];
+            } else {
+                float d = sd.depth<F>(x + y * sd.width);
+                r = vec2(d, d);
+            }
+            range.x = std::min(range.x, r.x);
+            range.y = std::max(range.y, r.y);
+        }
+    }
+    return range;
 }
 
 float HardShadowStrategy::calculate_shadow(int light_idx, const vec3 &world_pos, const vec3 &normal, const ShaderContext *context) {
     // 正面剔除对 Shadow Acne 以及 Peter Panning 效果很好，因此不用再做 Depth Bias
-    const auto& sd = context->shadow_datas[light_idx];
-    const auto& light = (*context->lights)[light_idx];
+    const auto& sd = select_shadow_map(light_idx, world_pos, context);
 
     vec4 light_space_pos = sd.light_vp * embed<4>(world_pos, 1.f);
     vec3 proj = light_space_pos.xyz() / light_space_pos.w;
     vec2 uv = vec2(proj.x + 1.f, proj.y + 1.f) * 0.5f;
     float z_screen = (1.f - proj.z) * 0.5f; // Reverse-Z 映射
 
-    return (z_screen < sample_buffer(sd.buffer, uv)) ? 0.0f : 1.0f;
+    return visit_depth_format(sd.format, [&](auto f) { return shadow<f>(sd, uv, z_screen); });
+}
+
+template<DepthFormat F>
+float HardShadowStrategy::shadow(const ShadowMapData& sd, vec2 uv, float z_screen) {
+    return (z_screen < sample_buffer<F>(sd, uv)) ? 0.0f : 1.0f;
 }
 
 float PCSSShadowStrategy::calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) {
-    const auto& sd = context->shadow_datas[light_idx];
-    const auto& light = (*context->lights)[light_idx];
+    const auto& sd = select_shadow_map(light_idx, world_pos, context);
 
     vec4 light_space_pos = sd.light_vp * embed<4>(world_pos, 1.f);
     vec3 proj = light_space_pos.xyz() / light_space_pos.w;
     vec2 uv = vec2(proj.x + 1.f, proj.y + 1.f) * 0.5f;
     float z_screen = (1.f - proj.z) * 0.5f; // Reverse-Z 映射
 
+    return visit_depth_format(sd.format, [&](auto f) { return shadow<f>(sd, uv, z_screen); });
+}
+
+template<DepthFormat F>
+float PCSSShadowStrategy::shadow(const ShadowMapData& sd, vec2 uv, float z_screen) {
+    const float search_radius = SEARCH_RADIUS * sd.filter_scale;
+    auto fetch = [&sd](int i) { return sd.depth<F>(i); };
+
+    // 双线性采样的结果不会超出所触及 texel 的深度范围，因此基于 min/max 金字塔的提前返回与完整的 PCSS 结果一致
+    const bool use_mips = !sd.depth_mips.empty();
+
+    // 搜索区域内没有比接收点更近的深度：找不到遮挡物，完全受光
+    if(use_mips && z_screen >= depth_range<F>(sd, uv, search_radius).y) return 1.0f;
+
     // Blocker Search
     float avg_blocker_depth = 0;
     int blocker_count = 0;
-    float search_radius = 0.01f; // 搜索半径
 
     for(int i = 0; i < 16; i++) {
-        float z_sample = sample_buffer_bilinear(sd.buffer, uv + poisson_disk[i] * search_radius);
+        float z_sample = sample_buffer_bilinear(sd, uv + poisson_disk[i] * search_radius, fetch);
         if(z_screen < z_sample) { 
             avg_blocker_depth += z_sample;
             blocker_count++;
@@ -377,18 +445,87 @@ float PCSSShadowStrategy::calculate_shadow(int light_idx, const vec3& world_pos,
     avg_blocker_depth /= (float)blocker_count;
 
     // Penumbra Estimation
-    // float w_light = 0.012f; 
-    float w_light = 0.025f;
-    float penumbra_radius = (avg_blocker_depth - z_screen) / avg_blocker_depth * w_light;
+    // Reverse-Z 的屏幕深度与 1 / 线性深度成仿射关系，先换算回 1 / 深度，使估计与拟合出的近远平面无关
+    float k = (sd.z_far - sd.z_near) / sd.z_near;
+    float blocker_ratio = (avg_blocker_depth - z_screen) * k / (avg_blocker_depth * k + 1.f);
+    // LIGHT_SIZE 曾试过 0.012f; 
+    float penumbra_radius = blocker_ratio * LIGHT_SIZE;
     // penumbra_radius = std::clamp(penumbra_radius, 0.0001f, 0.04f);
-    penumbra_radius = std::clamp(penumbra_radius, 0.0005f, 0.02f);
+    penumbra_radius = std::clamp(penumbra_radius, MIN_PENUMBRA, MAX_PENUMBRA) * sd.filter_scale;
+
+    // 过滤区域内全部比接收点更近 (完全处于阴影) 或全部更远 (完全受光) 时不存在半影，无需过滤
+    if(use_mips) {
+        vec2 range = depth_range<F>(sd, uv, penumbra_radius);
+        if(z_screen < range.x) return 0.0f;
+        if(z_screen >= range.y) return 1.0f;
+    }
 
     // Filtering
     float visibility = 0.0f;
     for(int i = 0; i < 16; i++) {
-        float z_sample = sample_buffer_bilinear(sd.buffer, uv + poisson_disk[i] * penumbra_radius);
+        float z_sample = sample_buffer_bilinear(sd, uv + poisson_disk[i] * penumbra_radius, fetch);
         visibility += (z_screen < z_sample) ? 0.0f : 1.0f;
     }
 
     return visibility / 16.0f;
 }
+
+float VSMShadowStrategy::linear_depth(const ShadowMapData& sd, float z_screen) {
+    const float n = sd.z_near, f = sd.z_far;
+    float ndc = 1.f - 2.f * z_screen;
+    return 2.f * n * f / ((f + n) - ndc * (f - n)) / f;
+}
+
+void VSMShadowStrategy::prefilter(ShadowMapData& sd) {
+    const int w = sd.width, h = sd.height, size = w * h;
+    std::vector<vec2> moments(size);
+    visit_depth_format(sd.format, [&](auto f) {
+        #pragma omp parallel for schedule(static)
+        for(int i = 0; i < size; i++) {
+            float d = linear_depth(sd, sd.depth<f>(i));
+            moments[i] = vec2(d, d * d);
+        }
+    });
+
+    // 可分离的盒式模糊：先水平、再竖直，越界的采样取边缘值
+    const float weight = 1.f / (2 * blur_radius + 1);
+    std::vector<vec2> blurred(size);
+    #pragma omp parallel for schedule(static)
+    for(int y = 0; y < h; y++) {
+        const vec2* row = &moments[y * w];
+        for(int x = 0; x < w; x++) {
+            vec2 sum(0, 0);
+            for(int k = -blur_radius; k <= blur_radius; k++) sum += row[std::clamp(x + k, 0, w - 1)];
+            blurred[x + y * w] = sum * weight;
+        }
+    }
+    sd.moments.resize(size);
+    #pragma omp parallel for schedule(static)
+    for(int y = 0; y < h; y++) {
+        vec2* out = &sd.moments[y * w];
+        std::fill(out, out + w, vec2(0, 0));
+        for(int k = -blur_radius; k <= blur_radius; k++) {
+            const vec2* row = &blurred[std::clamp(y + k, 0, h - 1) * w];
+            for(int x = 0; x < w; x++) out[x] += row[x];
+        }
+        for(int x = 0; x < w; x++) out[x] *= weight;
+    }
+}
+
+float VSMShadowStrategy::calculate_shadow(int light_idx, const vec3& world_pos, const vec3 &normal, const ShaderContext* context) {
+    const auto& sd = select_shadow_map(light_idx, world_pos, context);
+
+    vec4 light_space_pos = sd.light_vp * embed<4>(world_pos, 1.f);
+    vec3 proj = light_space_pos.xyz() / light_space_pos.w;
+    vec2 uv = vec2(std::clamp((proj.x + 1.f) * 0.5f, 0.f, 1.f), std::clamp((proj.y + 1.f) * 0.5f, 0.f, 1.f));
+    float depth = light_space_pos.w / sd.z_far; // 透视投影下 w 即视空间深度
+
+    // Chebyshev 不等式：接收点比平均遮挡深度更远时，给出可见比例的上界
+    vec2 m = sample_buffer_bilinear(sd, uv, [&sd](int i) { return sd.moments[i]; });
+    if(depth <= m.x) return 1.0f;
+    float variance = std::max(m.y - m.x * m.x, MIN_VARIANCE);
+    float d = depth - m.x;
+    float p_max = variance / (variance + d * d);
+
+    return std::clamp((p_max - LIGHT_BLEEDING) / (1.f - LIGHT_BLEEDING), 0.f, 1.f);
+}
@@ -1,56 +1,372 @@
 #include "texture.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 
-float Texture::handle_wrap(float v) const {
-    switch (wrap) {
-        case WrapMode::REPEAT: {
-            return v - std::floor(v);
-        }
-        case WrapMode::CLAMP: {
-            return std::clamp(v, 0.0f, 1.0f);
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TEXTURE_SSE2 1
+#include <emmintrin.h>
+#else
+#define TEXTURE_SSE2 0
+#endif
+
+/* ======== texel 排布 ======== */
+void TexelLevel::allocate(int w, int h, TexelLayout l) {
+    width = w, height = h, layout = l;
+    size_t count = (size_t)w * h;
+    if(l == TexelLayout::TILED) {
+        const int tile = 1 << TILE_BITS;
+        tiles_x = (w + tile - 1) / tile;
+        count = (size_t)tiles_x * ((h + tile - 1) / tile) * tile * tile;
+    } else if(l == TexelLayout::MORTON) {
+        int bits_x = 0, bits_y = 0;
+        while((1 << bits_x) < w) bits_x++;
+        while((1 << bits_y) < h) bits_y++;
+        morton_bits = std::min(bits_x, bits_y);
+        count = (size_t)1 << (bits_x + bits_y);
+    } else if(is_block_compressed(l)) {
+        // 4x4 块按行排列，count 以 4 字节为单位计
+        tiles_x = (w + 3) / 4;
+        count = ((size_t)tiles_x * ((h + 3) / 4) * block_bytes(l) + 3) / 4;
+    }
+    lines.assign((count + 15) / 16, TexelLine{});
+}
+
+// 逐行存放的层按 L 重新排布
+template<TexelLayout L>
+static TexelLevel relayout(const TexelLevel& src) {
+    TexelLevel dst;
+    dst.allocate(src.width, src.height, L);
+    for(int y = 0; y < src.height; y++) {
+        for(int x = 0; x < src.width; x++) dst.store<L>(x, y, src.fetch<TexelLayout::LINEAR>(x, y));
+    }
+    return dst;
+}
+
+/* ======== 加载：转换为 RGBA8 并生成 mip 链 ======== */
+// TGA 按 BGR(A) 存放，灰度图复制到 RGB 三个通道；纹理的 v 轴向上，解码时直接按自底向上的行序读入
+static TexelLevel decode_image(const std::string& filename, bool& alpha) {
+    TGAImage image(filename, true);
+    const int bpp = image.bytespp();
+    alpha = bpp == TGAImage::RGBA;
+
+    TexelLevel base;
+    base.allocate(image.width(), image.height(), TexelLayout::LINEAR);
+    const uint8_t* in = image.buffer();
+    uint32_t* out = base.texels();
+    const size_t count = (size_t)base.width * base.height;
+    for(size_t i = 0; i < count; i++, in += bpp) {
+        uint32_t r, g, b, a = 255;
+        if(bpp == TGAImage::GRAYSCALE) {
+            r = g = b = in[0];
+        } else {
+            b = in[0], g = in[1], r = in[2];
+            if(bpp == TGAImage::RGBA) a = in[3];
         }
-        case WrapMode::MIRROR: {
-            int i = (int)std::floor(v);
-            float frac = v - i;
-            return (std::abs(i) % 2 == 0) ? frac : (1.0f - frac);
+        out[i] = r | g << 8 | b << 16 | a << 24;
+    }
+    return base;
+}
+
+// 压缩结果的缓存文件，按源文件路径、用途与是否带 mip 链区分
+static std::string cache_path(const std::string& filename, TextureUsage usage, bool use_mips) {
+    static const char* usage_names[] = {"color", "data", "normal"};
+    std::string name = filename;
+    std::replace_if(name.begin(), name.end(), [](char c) { return c == '/' || c == '\\' || c == ':'; }, '_');
+    return TEXTURE_CACHE_DIR + "/" + name + "." + usage_names[(int)usage] + (use_mips ? ".mips" : "") + ".bct";
+}
+
+Texture::Texture(const std::string filename, const TextureOptions& options, TextureUsage usage) 
+    : mode(options.filter), wrap(options.wrap), max_anisotropy(std::max(1, options.max_anisotropy)), layout(options.layout) {
+    const bool use_mips = mode == Interpolation::TRILINEAR || mode == Interpolation::ANISOTROPIC;
+    const std::string cache = options.compress ? cache_path(filename, usage, use_mips) : "";
+
+    if(cache.empty() || !read_cache(cache, filename)) {
+        mips.push_back(decode_image(filename, alpha));
+        if(use_mips) generate_mips();
+
+        // mip 链在逐行排布下生成，最后统一压缩或重排
+        if(options.compress) {
+            compress(usage == TextureUsage::TANGENT_NORMAL ? TexelLayout::BC5 : alpha ? TexelLayout::BC3 : TexelLayout::BC1);
+            write_cache(cache, filename);
+        } else {
+            for(TexelLevel& lv : mips) {
+                if(layout == TexelLayout::TILED) lv = relayout<TexelLayout::TILED>(lv);
+                else if(layout == TexelLayout::MORTON) lv = relayout<TexelLayout::MORTON>(lv);
+            }
         }
     }
-    return v;
+    sampler = select_sampler(mode, wrap, layout);
 }
 
-TGAColor Texture::sample_uv(vec2 uv) const {
-    switch(mode) {
-        case Interpolation::NEAREST: {
-            int x = static_cast<int>(handle_wrap(uv.x) * data->width());
-            int y = static_cast<int>(handle_wrap(uv.y) * data->height());
-            return data->get(x, y);
+size_t Texture::size_in_bytes() const {
+    size_t total = 0;
+    for(const TexelLevel& lv : mips) total += lv.size_in_bytes();
+    return total;
+}
+
+/* ======== 块压缩与缓存 ======== */
+void Texture::compress(TexelLayout format) {
+    for(TexelLevel& lv : mips) {
+        TexelLevel dst;
+        dst.allocate(lv.width, lv.height, format);
+        for(int by = 0; by < lv.height; by += 4) {
+            for(int bx = 0; bx < lv.width; bx += 4) {
+                // 越过边界的 texel 复制边缘，不影响端点的选择
+                uint32_t texels[16];
+                for(int i = 0; i < 16; i++) {
+                    int x = std::min(bx + i % 4, lv.width - 1), y = std::min(by + i / 4, lv.height - 1);
+                    texels[i] = lv.fetch<TexelLayout::LINEAR>(x, y);
+                }
+                uint8_t* block = dst.bytes() + ((size_t)(by / 4) * dst.tiles_x + bx / 4) * TexelLevel::block_bytes(format);
+                if(format == TexelLayout::BC1) BC::encode_bc1(texels, block);
+                else if(format == TexelLayout::BC3) BC::encode_bc3(texels, block);
+                else BC::encode_bc5(texels, block);
+            }
         }
-        case Interpolation::BILINEAR: {
-            float u = handle_wrap(uv.x) * (data->width() - 1);
-            float v = handle_wrap(uv.y) * (data->height() - 1);
-
-            int x0 = static_cast<int>(std::floor(u));
-            int y0 = static_cast<int>(std::floor(v));
-            int x1 = std::min(x0 + 1, data->width() - 1);
-            int y1 = std::min(y0 + 1, data->height() - 1);
-
-            float tx = u - x0;
-            float ty = v - y0;
-
-            TGAColor c00 = data->get(x0, y0);
-            TGAColor c10 = data->get(x1, y0);
-            TGAColor c01 = data->get(x0, y1);
-            TGAColor c11 = data->get(x1, y1);
-
-            TGAColor result;
-            result.bytespp = c00.bytespp;
-            for (int i = 0; i < c00.bytespp; i++) {
-                // 水平方向插值
-                float color_top    = c00[i] + tx * (c10[i] - c00[i]);
-                float color_bottom = c01[i] + tx * (c11[i] - c01[i]);
-                // 垂直方向插值
-                result[i] = static_cast<uint8_t>(color_top + ty * (color_bottom - color_top));
+        lv = std::move(dst);
+    }
+    layout = format;
+}
+
+/* 缓存文件：头部记录源文件的大小与修改时间，任一不符即视为过期并重新压缩 */
+struct TextureCacheHeader {
+    char magic[4] = {'B', 'C', 'T', 'X'};
+    uint32_t version = 1;
+    uint64_t source_size = 0;
+    int64_t source_time = 0;
+    int32_t layout = 0, alpha = 0, levels = 0;
+};
+
+static bool source_stamp(const std::string& source, uint64_t& size, int64_t& time) {
+    std::error_code ec;
+    size = std::filesystem::file_size(source, ec);
+    if(ec) return false;
+    time = std::filesystem::last_write_time(source, ec).time_since_epoch().count();
+    return !ec;
+}
+
+bool Texture::read_cache(const std::string& path, const std::string& source) {
+    std::ifstream in(path, std::ios::binary);
+    if(!in) return false;
+
+    TextureCacheHeader header, expected;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!in || std::memcmp(header.magic, expected.magic, 4) != 0 || header.version != expected.version) return false;
+    if(!source_stamp(source, expected.source_size, expected.source_time)) return false;
+    if(header.source_size != expected.source_size || header.source_time != expected.source_time) return false;
+    if(!is_block_compressed((TexelLayout)header.layout) || header.levels <= 0) return false;
+
+    std::vector<TexelLevel> levels(header.levels);
+    for(TexelLevel& lv : levels) {
+        int32_t size[2];
+        in.read(reinterpret_cast<char*>(size), sizeof(size));
+        if(!in || size[0] <= 0 || size[1] <= 0) return false;
+        lv.allocate(size[0], size[1], (TexelLayout)header.layout);
+        in.read(reinterpret_cast<char*>(lv.bytes()), lv.size_in_bytes());
+        if(!in) return false;
+    }
+    mips = std::move(levels);
+    layout = (TexelLayout)header.layout;
+    alpha = header.alpha;
+    return true;
+}
+
+void Texture::write_cache(const std::string& path, const std::string& source) const {
+    TextureCacheHeader header;
+    if(!source_stamp(source, header.source_size, header.source_time)) return;
+    header.layout = (int32_t)layout;
+    header.alpha = alpha;
+    header.levels = (int32_t)mips.size();
+
+    // 缓存只是加速手段，目录或文件无法写入时直接放弃
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    std::ofstream out(path, std::ios::binary);
+    if(!out) return;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for(const TexelLevel& lv : mips) {
+        int32_t size[2] = {lv.width, lv.height};
+        out.write(reinterpret_cast<const char*>(size), sizeof(size));
+        out.write(reinterpret_cast<const char*>(lv.bytes()), lv.size_in_bytes());
+    }
+}
+
+void Texture::generate_mips() {
+    // 每层由上一层 2x2 盒式滤波得到，奇数边长时最后一行/列的 texel 重复参与平均
+    while(mips.back().width > 1 || mips.back().height > 1) {
+        const TexelLevel& src = mips.back();
+        TexelLevel dst;
+        dst.allocate(std::max(1, src.width / 2), std::max(1, src.height / 2), TexelLayout::LINEAR);
+        for(int y = 0; y < dst.height; y++) {
+            int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+            for(int x = 0; x < dst.width; x++) {
+                int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                constexpr TexelLayout L = TexelLayout::LINEAR;
+                uint32_t c[4] = {src.fetch<L>(x0, y0), src.fetch<L>(x1, y0), src.fetch<L>(x0, y1), src.fetch<L>(x1, y1)};
+                uint32_t result = 0;
+                for(int shift = 0; shift < 32; shift += 8) {
+                    uint32_t sum = 2;
+                    for(uint32_t t : c) sum += t >> shift & 0xFF;
+                    result |= (sum / 4) << shift;
+                }
+                dst.store<L>(x, y, result);
             }
-            return result;
         }
+        mips.push_back(std::move(dst));
+    }
+}
+
+/* ======== 环绕与单层采样 ======== */
+template<WrapMode W>
+static float wrap_coord(float v) {
+    if constexpr (W == WrapMode::REPEAT) {
+        return v - std::floor(v);
+    } else if constexpr (W == WrapMode::CLAMP) {
+        return std::clamp(v, 0.0f, 1.0f);
+    } else {
+        int i = (int)std::floor(v);
+        float frac = v - i;
+        return (std::abs(i) % 2 == 0) ? frac : (1.0f - frac);
+    }
+}
+
+/* 采样的中间结果：4 个通道的 float，取值 [0, 255]，在 SSE2 下整体放在一个寄存器中 */
+#if TEXTURE_SSE2
+using Texel4 = __m128;
+
+// 一个 RGBA8 texel 展开为 4 个 float
+static inline Texel4 unpack_texel(uint32_t t) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_cvtsi32_si128((int)t);
+    v = _mm_unpacklo_epi8(v, zero);
+    v = _mm_unpacklo_epi16(v, zero);
+    return _mm_cvtepi32_ps(v);
+}
+static inline Texel4 lerp(Texel4 a, Texel4 b, float t) { return _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(t), _mm_sub_ps(b, a))); }
+static inline Texel4 add(Texel4 a, Texel4 b) { return _mm_add_ps(a, b); }
+static inline Texel4 zero_texel() { return _mm_setzero_ps(); }
+static inline vec4 normalize_texel(Texel4 c, float scale) {
+    alignas(16) float out[4];
+    _mm_store_ps(out, _mm_mul_ps(c, _mm_set1_ps(scale / 255.f)));
+    return vec4(out[0], out[1], out[2], out[3]);
+}
+#else
+using Texel4 = vec4;
+
+static inline Texel4 unpack_texel(uint32_t t) {
+    return vec4(t & 0xFF, t >> 8 & 0xFF, t >> 16 & 0xFF, t >> 24);
+}
+static inline Texel4 lerp(Texel4 a, Texel4 b, float t) { return a + (b - a) * t; }
+static inline Texel4 add(Texel4 a, Texel4 b) { return a + b; }
+static inline Texel4 zero_texel() { return vec4(0, 0, 0, 0); }
+static inline vec4 normalize_texel(Texel4 c, float scale) { return c * (scale / 255.f); }
+#endif
+
+template<WrapMode W, TexelLayout L>
+static Texel4 sample_nearest(const TexelLevel& lv, vec2 uv) {
+    int x = std::min(static_cast<int>(wrap_coord<W>(uv.x) * lv.width), lv.width - 1);
+    int y = std::min(static_cast<int>(wrap_coord<W>(uv.y) * lv.height), lv.height - 1);
+    return unpack_texel(lv.fetch<L>(x, y));
+}
+
+template<WrapMode W, TexelLayout L>
+static Texel4 sample_bilinear(const TexelLevel& lv, vec2 uv) {
+    float u = wrap_coord<W>(uv.x) * (lv.width - 1);
+    float v = wrap_coord<W>(uv.y) * (lv.height - 1);
+
+    int x0 = static_cast<int>(std::floor(u));
+    int y0 = static_cast<int>(std::floor(v));
+    int x1 = std::min(x0 + 1, lv.width - 1);
+    int y1 = std::min(y0 + 1, lv.height - 1);
+
+    float tx = u - x0;
+    float ty = v - y0;
+
+    // 4 个通道同时插值：先水平、再垂直
+    uint32_t t00, t10, t01, t11;
+    if constexpr (is_block_compressed(L)) {
+        t00 = lv.fetch<L>(x0, y0), t10 = lv.fetch<L>(x1, y0), t01 = lv.fetch<L>(x0, y1), t11 = lv.fetch<L>(x1, y1);
+    } else {
+        const uint32_t* texels = lv.texels();
+        size_t c0 = lv.column<L>(x0), c1 = lv.column<L>(x1), r0 = lv.row<L>(y0), r1 = lv.row<L>(y1);
+        t00 = texels[c0 + r0], t10 = texels[c1 + r0], t01 = texels[c0 + r1], t11 = texels[c1 + r1];
+    }
+    Texel4 top = lerp(unpack_texel(t00), unpack_texel(t10), tx);
+    Texel4 bottom = lerp(unpack_texel(t01), unpack_texel(t11), tx);
+    return lerp(top, bottom, ty);
+}
+
+// 在相邻两层之间按 lod 的小数部分插值
+template<WrapMode W, TexelLayout L>
+static Texel4 sample_trilinear(const Texture& tex, vec2 uv, float lod) {
+    lod = std::clamp(lod, 0.f, (float)(tex.levels() - 1));
+    int l0 = (int)lod;
+    float t = lod - l0;
+    Texel4 c0 = sample_bilinear<W, L>(tex.level(l0), uv);
+    if(t == 0.f) return c0;
+    return lerp(c0, sample_bilinear<W, L>(tex.level(l0 + 1), uv), t);
+}
+
+/* ======== 特化的采样函数 ======== */
+template<Interpolation F, WrapMode W, TexelLayout L>
+static vec4 sample_texture(const Texture& tex, vec2 uv, vec2 duv_dx, vec2 duv_dy) {
+    if constexpr (F == Interpolation::NEAREST) {
+        return normalize_texel(sample_nearest<W, L>(tex.level(0), uv), 1.f);
+    } else if constexpr (F == Interpolation::BILINEAR) {
+        return normalize_texel(sample_bilinear<W, L>(tex.level(0), uv), 1.f);
+    } else {
+        // 采样足迹在 texel 空间中的两条轴
+        const TexelLevel& base = tex.level(0);
+        float len_x = vec2(duv_dx.x * base.width, duv_dx.y * base.height).norm();
+        float len_y = vec2(duv_dy.x * base.width, duv_dy.y * base.height).norm();
+        float len_max = std::max(len_x, len_y), len_min = std::min(len_x, len_y);
+
+        // 各向同性：按足迹的长轴选层；各向异性：按短轴选层，沿长轴分布多次三线性采样
+        int taps = 1;
+        if constexpr (F == Interpolation::ANISOTROPIC) {
+            if(len_min > 0.f) taps = std::min((int)std::ceil(len_max / len_min), tex.max_anisotropy);
+        }
+        float lod = len_max > 0.f ? std::log2(len_max / taps) : 0.f;
+        if(lod <= 0.f && taps == 1) return normalize_texel(sample_bilinear<W, L>(base, uv), 1.f); // 放大：只需原图
+        if(taps == 1) return normalize_texel(sample_trilinear<W, L>(tex, uv, lod), 1.f);
+
+        vec2 axis = len_x >= len_y ? duv_dx : duv_dy;
+        Texel4 sum = zero_texel();
+        for(int i = 0; i < taps; i++) {
+            float offset = (i + 0.5f) / taps - 0.5f;
+            sum = add(sum, sample_trilinear<W, L>(tex, uv + axis * offset, lod));
+        }
+        return normalize_texel(sum, 1.f / taps);
+    }
+}
+
+template<Interpolation F, WrapMode W>
+static TextureSampler select_layout(TexelLayout l) {
+    switch(l) {
+        case TexelLayout::TILED: return &sample_texture<F, W, TexelLayout::TILED>;
+        case TexelLayout::MORTON: return &sample_texture<F, W, TexelLayout::MORTON>;
+        case TexelLayout::BC1: return &sample_texture<F, W, TexelLayout::BC1>;
+        case TexelLayout::BC3: return &sample_texture<F, W, TexelLayout::BC3>;
+        case TexelLayout::BC5: return &sample_texture<F, W, TexelLayout::BC5>;
+        default: return &sample_texture<F, W, TexelLayout::LINEAR>;
+    }
+}
+
+template<Interpolation F>
+static TextureSampler select_wrap(WrapMode w, TexelLayout l) {
+    switch(w) {
+        case WrapMode::CLAMP: return select_layout<F, WrapMode::CLAMP>(l);
+        case WrapMode::MIRROR: return select_layout<F, WrapMode::MIRROR>(l);
+        default: return select_layout<F, WrapMode::REPEAT>(l);
+    }
+}
+
+TextureSampler Texture::select_sampler(Interpolation m, WrapMode w, TexelLayout l) {
+    switch(m) {
+        case Interpolation::NEAREST: return select_wrap<Interpolation::NEAREST>(w, l);
+        case Interpolation::TRILINEAR: return select_wrap<Interpolation::TRILINEAR>(w, l);
+        case Interpolation::ANISOTROPIC: return select_wrap<Interpolation::ANISOTROPIC>(w, l);
+        default: return select_wrap<Interpolation::BILINEAR>(w, l);
     }
 }
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <string>
 #include "tgaimage.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp, TGAColor c) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {
@@ -8,7 +10,7 @@ TGAImage::TGAImage(const int w, const int h, const int bpp, TGAColor c) : w(w),
             set(i, j, c);
 }
 
-bool TGAImage::read_tga_file(const std::string filename) {
+bool TGAImage::read_tga_file(const std::string filename, const bool vflip) {
     std::ifstream in;
     in.open(filename, std::ios::binary);
     if (!in.is_open()) {
@@ -28,16 +30,29 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "bad bpp (or width/height) value\n";
         return false;
     }
+    in.ignore(header.idlength);
     size_t nbytes = bpp*w*h;
     data = std::vector<std::uint8_t>(nbytes, 0);
+    // 文件中的行序与目标行序 (vflip 时自底向上) 不一致时，解码时直接写到翻转后的行
+    const bool reverse = !(header.imagedescriptor & 0x20) != vflip;
     if (3==header.datatypecode || 2==header.datatypecode) {
-        in.read(reinterpret_cast<char *>(data.data()), nbytes);
+        if (!reverse)
+            in.read(reinterpret_cast<char *>(data.data()), nbytes);
+        else
+            for (int j=h-1; j>=0 && in.good(); j--)
+                in.read(reinterpret_cast<char *>(data.data()+j*w*bpp), w*bpp);
         if (!in.good()) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
     } else if (10==header.datatypecode||11==header.datatypecode) {
-        if (!load_rle_data(in)) {
+        // 压缩数据整体读入缓冲区后再解码
+        const auto start = in.tellg();
+        in.seekg(0, std::ios::end);
+        std::vector<std::uint8_t> rle(static_cast<size_t>(in.tellg()-start));
+        in.seekg(start);
+        in.read(reinterpret_cast<char *>(rle.data()), rle.size());
+        if (!in.good() || !load_rle_data(rle.data(), rle.data()+rle.size(), reverse)) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
@@ -45,60 +60,48 @@ bool TGAImage::read_tga_file(const std::string filename) {
         std::cerr << "unknown file format " << (int)header.datatypecode << "\n";
         return false;
     }
-    if (!(header.imagedescriptor & 0x20))
-        flip_vertically();
     if (header.imagedescriptor & 0x10)
         flip_horizontally();
-    std::cerr << w << "x" << h << "/" << bpp*8 << "\n";
+    std::cerr << std::to_string(w) + "x" + std::to_string(h) + "/" + std::to_string(bpp*8) + "\n"; // 整行输出，并行加载时不会交错
     return true;
 }
 
-bool TGAImage::load_rle_data(std::ifstream &in) {
+bool TGAImage::load_rle_data(const std::uint8_t *in, const std::uint8_t *end, const bool reverse) {
     size_t pixelcount = w*h;
     size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+    while (currentpixel < pixelcount) {
+        if (in>=end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+        std::uint8_t chunkheader = *in++;
+        const bool raw = chunkheader<128;
+        size_t count = raw ? chunkheader+1 : chunkheader-127;
+        if (currentpixel+count>pixelcount) {
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+        if (size_t(end-in)<(raw ? count*bpp : bpp)) {
+            std::cerr << "an error occured while reading the header\n";
+            return false;
+        }
+        // 一个包可能跨行，按行切分后写入
+        while (count) {
+            int x = currentpixel%w, y = currentpixel/w;
+            size_t n = std::min<size_t>(count, w-x);
+            std::uint8_t *out = data.data()+((reverse ? h-1-y : y)*w+x)*bpp;
+            if (raw) {
+                memcpy(out, in, n*bpp);
+                in += n*bpp;
+            } else {
+                for (size_t i=0; i<n; i++, out+=bpp)
+                    memcpy(out, in, bpp);
             }
+            currentpixel += n;
+            count -= n;
         }
-    } while (currentpixel < pixelcount);
+        if (!raw) in += bpp;
+    }
     return true;
 }
 